@@ -3,7 +3,19 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
+#include "threads/interrupt.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+#ifdef P4FILESYS
+#include "filesys/free-map.h"
+#endif
+
+/* Number of buckets in a latency histogram. */
+#define HIST_BUCKETS 40
 
 /* A block device. */
 struct block
@@ -19,8 +31,56 @@ struct block
 
     unsigned long long read_cnt;        /* Number of sectors read. */
     unsigned long long write_cnt;       /* Number of sectors written. */
+    unsigned long long read_multi_cnt;  /* Calls to block_read_multi(). */
+    unsigned long long write_multi_cnt; /* Calls to block_write_multi(). */
+
+    /* Request queue, used if the driver called block_queue_start(). */
+    bool queued;                        /* Requests go through queue? */
+    struct lock queue_lock;             /* Protects the members below,
+                                           and the transfer counts. */
+    struct condition queue_cond;        /* Signaled when a request arrives. */
+    struct list queue;                  /* Pending requests by sector. */
+    struct list fifo;                   /* Pending requests by arrival. */
+    block_sector_t head;                /* Sector after last dispatched. */
+    void *bounce;                       /* Buffer for merged requests. */
+    struct thread *dispatcher;          /* Dispatch thread. */
+    unsigned long long dispatch_cnt;    /* Commands sent to the driver. */
+    unsigned long long merge_cnt;       /* Requests merged into another. */
+    unsigned long long expire_cnt;      /* Dispatched past deadline. */
+
+    /* Devices with the same non-null channel cannot transfer at
+       the same time, e.g. two disks on one IDE channel. */
+    const void *channel;
+
+    /* If nonnull, requests are passed to PARENT, offset by
+       PARENT_START sectors, e.g. for a partition. */
+    struct block *parent;               /* Device that does the I/O. */
+    block_sector_t parent_start;        /* First sector within PARENT. */
+
+    /* Instrumentation.  Times are in CPU cycles, bucketed by
+       floor(log2). */
+    unsigned long long latency_hist[HIST_BUCKETS]; /* Submit to done. */
+    unsigned long long service_hist[HIST_BUCKETS]; /* In the driver. */
+    unsigned long long request_cnt;     /* Requests submitted. */
+    unsigned long long seq_cnt;         /* Transfers at last_end. */
+    unsigned long long random_cnt;      /* Other transfers. */
+    block_sector_t last_end;            /* Sector after last transfer. */
+    unsigned depth;                     /* Requests not yet completed. */
+    unsigned max_depth;                 /* Largest DEPTH seen. */
+    unsigned long long depth_sum;       /* Sum of DEPTH at each submit. */
   };
 
+/* How long a request may wait before it is served out of
+   elevator order, in timer ticks.  Reads have someone waiting on
+   them, so they get the shorter deadline. */
+#define READ_EXPIRE (TIMER_FREQ / 2)
+#define WRITE_EXPIRE (TIMER_FREQ * 5)
+
+/* Most sectors merged into one driver command, and the size of
+   the bounce buffer that merged requests go through. */
+#define MERGE_MAX 32
+#define BOUNCE_PAGES (MERGE_MAX * BLOCK_SECTOR_SIZE / PGSIZE)
+
 /* List of all block devices. */
 static struct list all_blocks = LIST_INITIALIZER (all_blocks);
 
@@ -113,6 +173,329 @@ check_sector (struct block *block, block_sector_t sector)
     }
 }
 
+/* Returns the CPU's time stamp counter. */
+static inline uint64_t
+rdtsc (void)
+{
+  uint64_t tsc;
+  asm volatile ("rdtsc" : "=A" (tsc));
+  return tsc;
+}
+
+/* Adds CYCLES to histogram HIST. */
+static void
+hist_add (unsigned long long hist[HIST_BUCKETS], uint64_t cycles)
+{
+  int bucket = 0;
+
+  while (cycles > 1 && bucket < HIST_BUCKETS - 1)
+    {
+      cycles >>= 1;
+      bucket++;
+    }
+  hist[bucket]++;
+}
+
+/* Has BLOCK's driver transfer the CNT sectors starting at SECTOR
+   to or from BUFFER, one command if the driver can. */
+static void
+block_transfer (struct block *block, block_sector_t sector, size_t cnt,
+                void *buffer, bool write)
+{
+  uint64_t start = rdtsc ();
+  size_t i;
+
+  lock_acquire (&block->queue_lock);
+  if (sector == block->last_end)
+    block->seq_cnt++;
+  else
+    block->random_cnt++;
+  block->last_end = sector + cnt;
+  lock_release (&block->queue_lock);
+
+  if (cnt == 1)
+    {
+      if (write)
+        block->ops->write (block->aux, sector, buffer);
+      else
+        block->ops->read (block->aux, sector, buffer);
+    }
+  else if (write && block->ops->write_multi != NULL)
+    block->ops->write_multi (block->aux, sector, cnt, buffer);
+  else if (!write && block->ops->read_multi != NULL)
+    block->ops->read_multi (block->aux, sector, cnt, buffer);
+  else
+    for (i = 0; i < cnt; i++)
+      {
+        uint8_t *p = (uint8_t *) buffer + i * BLOCK_SECTOR_SIZE;
+        if (write)
+          block->ops->write (block->aux, sector + i, p);
+        else
+          block->ops->read (block->aux, sector + i, p);
+      }
+  lock_acquire (&block->queue_lock);
+  hist_add (block->service_hist, rdtsc () - start);
+  lock_release (&block->queue_lock);
+}
+
+/* Counts CNT sectors read or written, per WRITE, on BLOCK by one
+   call, which counts as a multi-sector call if MULTI. */
+static void
+block_count (struct block *block, size_t cnt, bool write, bool multi)
+{
+  lock_acquire (&block->queue_lock);
+  if (write)
+    {
+      block->write_cnt += cnt;
+      if (multi)
+        block->write_multi_cnt++;
+    }
+  else
+    {
+      block->read_cnt += cnt;
+      if (multi)
+        block->read_multi_cnt++;
+    }
+  lock_release (&block->queue_lock);
+}
+
+/* Marks request R on BLOCK complete and wakes its waiter. */
+static void
+block_complete (struct block *block, struct block_request *r)
+{
+  enum intr_level old_level = intr_disable ();
+  hist_add (block->latency_hist, rdtsc () - r->start);
+  block->depth--;
+  intr_set_level (old_level);
+
+  sema_up (&r->done);
+}
+
+/* Orders block requests by first sector. */
+static bool
+request_less (const struct list_elem *a_, const struct list_elem *b_,
+              void *aux UNUSED)
+{
+  const struct block_request *a = list_entry (a_, struct block_request, elem);
+  const struct block_request *b = list_entry (b_, struct block_request, elem);
+
+  return a->sector < b->sector;
+}
+
+/* Starts transferring CNT sectors between BLOCK and BUFFER as
+   request R.  If BLOCK has a request queue, queues R for the
+   dispatch thread and returns at once; otherwise, or if called by
+   the dispatch thread itself (say, to flush the file system on a
+   panic), calls the driver directly.  If BLOCK has a parent, R
+   goes to the parent's queue instead.  Either way, R is complete
+   once block_wait() returns. */
+static void
+block_submit (struct block *block, block_sector_t sector, size_t cnt,
+              void *buffer, bool write, struct block_request *r)
+{
+  enum intr_level old_level;
+
+  if (block->parent != NULL)
+    {
+      old_level = intr_disable ();
+      block->request_cnt++;
+      intr_set_level (old_level);
+      block_submit (block->parent, block->parent_start + sector, cnt,
+                    buffer, write, r);
+      return;
+    }
+
+  r->sector = sector;
+  r->cnt = cnt;
+  r->buffer = buffer;
+  r->write = write;
+  r->start = rdtsc ();
+  sema_init (&r->done, 0);
+
+  old_level = intr_disable ();
+  block->request_cnt++;
+  block->depth++;
+  block->depth_sum += block->depth;
+  if (block->depth > block->max_depth)
+    block->max_depth = block->depth;
+  intr_set_level (old_level);
+
+  if (!block->queued || block->dispatcher == thread_current ())
+    {
+      block_transfer (block, sector, cnt, buffer, write);
+      block_complete (block, r);
+      return;
+    }
+
+  r->deadline = timer_ticks () + (write ? WRITE_EXPIRE : READ_EXPIRE);
+  lock_acquire (&block->queue_lock);
+  list_insert_ordered (&block->queue, &r->elem, request_less, NULL);
+  list_push_back (&block->fifo, &r->fifo_elem);
+  cond_signal (&block->queue_cond, &block->queue_lock);
+  lock_release (&block->queue_lock);
+}
+
+/* Transfers CNT sectors between BLOCK and BUFFER and waits for
+   the transfer to finish. */
+static void
+block_io (struct block *block, block_sector_t sector, size_t cnt,
+          void *buffer, bool write)
+{
+  struct block_request r;
+
+  block_submit (block, sector, cnt, buffer, write, &r);
+  block_wait (&r);
+}
+
+/* Chooses the next request to serve from BLOCK's queue, which
+   must not be empty.  The oldest request wins once its deadline
+   has passed; otherwise requests are served in one-way (C-SCAN)
+   elevator order: the lowest sector at or past the head, then
+   back to the lowest sector on the disk. */
+static struct block_request *
+block_pick (struct block *block)
+{
+  struct block_request *oldest;
+  struct list_elem *e;
+
+  ASSERT (lock_held_by_current_thread (&block->queue_lock));
+  ASSERT (!list_empty (&block->queue));
+
+  oldest = list_entry (list_front (&block->fifo),
+                       struct block_request, fifo_elem);
+  if (timer_ticks () >= oldest->deadline)
+    {
+      block->expire_cnt++;
+      return oldest;
+    }
+
+  for (e = list_begin (&block->queue); e != list_end (&block->queue);
+       e = list_next (e))
+    {
+      struct block_request *r = list_entry (e, struct block_request, elem);
+      if (r->sector >= block->head)
+        return r;
+    }
+  return list_entry (list_front (&block->queue), struct block_request, elem);
+}
+
+/* Dispatch thread for a block device with a request queue.
+   Takes the request chosen by block_pick() together with the
+   queued requests in the same direction that follow it on disk
+   without a gap, and serves them with one driver call through
+   the bounce buffer. */
+static void
+block_dispatch (void *block_)
+{
+  struct block *block = block_;
+
+  block->dispatcher = thread_current ();
+  for (;;)
+    {
+      struct block_request *batch[MERGE_MAX];
+      struct block_request *r;
+      size_t n = 0, cnt, i;
+      block_sector_t sector;
+      uint8_t *p;
+
+      lock_acquire (&block->queue_lock);
+      while (list_empty (&block->queue))
+        cond_wait (&block->queue_cond, &block->queue_lock);
+
+      r = block_pick (block);
+      sector = r->sector;
+      cnt = 0;
+      for (;;)
+        {
+          struct list_elem *next = list_next (&r->elem);
+
+          batch[n++] = r;
+          cnt += r->cnt;
+          list_remove (&r->elem);
+          list_remove (&r->fifo_elem);
+          if (block->bounce == NULL || next == list_end (&block->queue))
+            break;
+
+          r = list_entry (next, struct block_request, elem);
+          if (r->write != batch[0]->write || r->sector != sector + cnt
+              || cnt + r->cnt > MERGE_MAX || n == MERGE_MAX)
+            break;
+        }
+      block->head = sector + cnt;
+      block->dispatch_cnt++;
+      block->merge_cnt += n - 1;
+      lock_release (&block->queue_lock);
+
+      if (n == 1)
+        block_transfer (block, sector, cnt, batch[0]->buffer,
+                        batch[0]->write);
+      else if (batch[0]->write)
+        {
+          for (i = 0, p = block->bounce; i < n; i++)
+            {
+              memcpy (p, batch[i]->buffer, batch[i]->cnt * BLOCK_SECTOR_SIZE);
+              p += batch[i]->cnt * BLOCK_SECTOR_SIZE;
+            }
+          block_transfer (block, sector, cnt, block->bounce, true);
+        }
+      else
+        {
+          block_transfer (block, sector, cnt, block->bounce, false);
+          for (i = 0, p = block->bounce; i < n; i++)
+            {
+              memcpy (batch[i]->buffer, p, batch[i]->cnt * BLOCK_SECTOR_SIZE);
+              p += batch[i]->cnt * BLOCK_SECTOR_SIZE;
+            }
+        }
+
+      for (i = 0; i < n; i++)
+        block_complete (block, batch[i]);
+    }
+}
+
+/* Gives BLOCK a request queue served by its own dispatch thread,
+   so that concurrent requests reach the driver in elevator order
+   and adjacent ones are merged.  Meant for drivers of physical
+   devices; block devices that forward to another one, such as
+   partitions, are scheduled by the device they forward to.  The
+   blocking block_read() and friends keep working unchanged. */
+void
+block_queue_start (struct block *block)
+{
+  ASSERT (!block->queued);
+
+  cond_init (&block->queue_cond);
+  list_init (&block->queue);
+  list_init (&block->fifo);
+  block->head = 0;
+  block->bounce = palloc_get_multiple (0, BOUNCE_PAGES);
+  block->dispatch_cnt = 0;
+  block->merge_cnt = 0;
+  block->expire_cnt = 0;
+  block->dispatcher = NULL;
+  block->queued = true;
+
+  if (thread_create (block->name, PRI_DEFAULT, block_dispatch, block)
+      == TID_ERROR)
+    PANIC ("%s: cannot start dispatch thread", block->name);
+}
+
+/* Makes BLOCK pass all of its requests to PARENT, at START sectors
+   into PARENT, instead of calling its own driver.  Meant for
+   devices such as partitions that are a window onto another one,
+   so that their asynchronous requests wait in, and are scheduled
+   by, PARENT's queue. */
+void
+block_set_parent (struct block *block, struct block *parent,
+                  block_sector_t start)
+{
+  ASSERT (!block->queued);
+  ASSERT (start + block->size <= parent->size);
+
+  block->parent = parent;
+  block->parent_start = start;
+}
+
 /* Reads sector SECTOR from BLOCK into BUFFER, which must
    have room for BLOCK_SECTOR_SIZE bytes.
    Internally synchronizes accesses to block devices, so external
@@ -121,8 +504,8 @@ void
 block_read (struct block *block, block_sector_t sector, void *buffer)
 {
   check_sector (block, sector);
-  block->ops->read (block->aux, sector, buffer);
-  block->read_cnt++;
+  block_io (block, sector, 1, buffer, false);
+  block_count (block, 1, false, false);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -135,8 +518,98 @@ block_write (struct block *block, block_sector_t sector, const void *buffer)
 {
   check_sector (block, sector);
   ASSERT (block->type != BLOCK_FOREIGN);
-  block->ops->write (block->aux, sector, buffer);
-  block->write_cnt++;
+  block_io (block, sector, 1, (void *) buffer, true);
+  block_count (block, 1, true, false);
+}
+
+/* Reads the CNT consecutive sectors starting at SECTOR from BLOCK
+   into BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  Drivers that can transfer several sectors in one
+   command do so; others are called once per sector. */
+void
+block_read_multi (struct block *block, block_sector_t sector, size_t cnt,
+                  void *buffer)
+{
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  block_io (block, sector, cnt, buffer, false);
+  block_count (block, cnt, false, true);
+}
+
+/* Writes the CNT consecutive sectors starting at SECTOR to BLOCK
+   from BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the block device has acknowledged receiving all
+   of the data.  Falls back to one WRITE per sector like
+   block_read_multi(). */
+void
+block_write_multi (struct block *block, block_sector_t sector, size_t cnt,
+                   const void *buffer)
+{
+  if (cnt == 0)
+    return;
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  ASSERT (block->type != BLOCK_FOREIGN);
+  block_io (block, sector, cnt, (void *) buffer, true);
+  block_count (block, cnt, true, true);
+}
+
+/* Starts reading the CNT consecutive sectors starting at SECTOR
+   from BLOCK into BUFFER, as request R, and returns without
+   waiting for the data.  BUFFER must not be used until
+   block_wait (R) returns.  Requests from one thread that are in
+   flight together give the elevator more to work with. */
+void
+block_read_async (struct block *block, block_sector_t sector, size_t cnt,
+                  void *buffer, struct block_request *r)
+{
+  ASSERT (cnt > 0);
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  block_submit (block, sector, cnt, buffer, false, r);
+  block_count (block, cnt, false, cnt > 1);
+}
+
+/* Starts writing the CNT consecutive sectors starting at SECTOR
+   to BLOCK from BUFFER, as request R, like block_read_async().
+   BUFFER must not be changed until block_wait (R) returns. */
+void
+block_write_async (struct block *block, block_sector_t sector, size_t cnt,
+                   const void *buffer, struct block_request *r)
+{
+  ASSERT (cnt > 0);
+  check_sector (block, sector);
+  check_sector (block, sector + cnt - 1);
+  ASSERT (block->type != BLOCK_FOREIGN);
+  block_submit (block, sector, cnt, (void *) buffer, true, r);
+  block_count (block, cnt, true, cnt > 1);
+}
+
+/* Waits for request R, started by block_read_async() or
+   block_write_async(), to complete. */
+void
+block_wait (struct block_request *r)
+{
+  sema_down (&r->done);
+}
+
+/* Records that BLOCK does its I/O over CHANNEL, an identifier
+   chosen by the driver.  Devices that share a channel cannot
+   transfer at the same time. */
+void
+block_set_channel (struct block *block, const void *channel)
+{
+  block->channel = channel;
+}
+
+/* Returns the channel that BLOCK does its I/O over, or a null
+   pointer if BLOCK does not share one with any other device. */
+const void *
+block_channel (struct block *block)
+{
+  return block->channel;
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -160,7 +633,89 @@ block_type (struct block *block)
   return block->type;
 }
 
-/* Prints statistics for each block device used for a Pintos role. */
+/* Prints histogram HIST of BLOCK, labeled LABEL, as the
+   nonempty buckets' log2 and count. */
+static void
+print_hist (const struct block *block, const char *label,
+            const unsigned long long hist[HIST_BUCKETS])
+{
+  int i;
+
+  printf ("%s: %s (log2 cycles: count):", block->name, label);
+  for (i = 0; i < HIST_BUCKETS; i++)
+    if (hist[i] != 0)
+      printf (" %d:%llu", i, hist[i]);
+  printf ("\n");
+}
+
+/* Prints the I/O instrumentation of every block device that has
+   served any requests.  Safe to call on a running system. */
+void
+block_print_io_stats (void)
+{
+  struct list_elem *e;
+
+  for (e = list_begin (&all_blocks); e != list_end (&all_blocks);
+       e = list_next (e))
+    {
+      struct block *block = list_entry (e, struct block, list_elem);
+      unsigned long long transfers = block->seq_cnt + block->random_cnt;
+
+      if (block->request_cnt == 0)
+        continue;
+      if (block->parent != NULL)
+        {
+          printf ("%s: %llu requests, %llu bytes read, %llu bytes written, "
+                  "served by %s\n", block->name, block->request_cnt,
+                  block->read_cnt * BLOCK_SECTOR_SIZE,
+                  block->write_cnt * BLOCK_SECTOR_SIZE, block->parent->name);
+          continue;
+        }
+      printf ("%s: %llu requests, %llu bytes read, %llu bytes written, "
+              "%llu of %llu transfers sequential\n",
+              block->name, block->request_cnt,
+              block->read_cnt * BLOCK_SECTOR_SIZE,
+              block->write_cnt * BLOCK_SECTOR_SIZE,
+              block->seq_cnt, transfers);
+      printf ("%s: queue depth %u now, %u max, %llu.%02llu average\n",
+              block->name, block->depth, block->max_depth,
+              block->depth_sum / block->request_cnt,
+              block->depth_sum * 100 / block->request_cnt % 100);
+      if (block->queued)
+        printf ("%s: %llu commands dispatched, %llu requests merged, "
+                "%llu past deadline\n", block->name,
+                block->dispatch_cnt, block->merge_cnt, block->expire_cnt);
+      print_hist (block, "latency", block->latency_hist);
+      print_hist (block, "service", block->service_hist);
+    }
+}
+
+/* I/O statistics thread: prints block_print_io_stats() every
+   INTERVAL_ seconds. */
+static void
+block_stats_worker (void *interval_)
+{
+  int interval = (int) interval_;
+
+  for (;;)
+    {
+      timer_sleep (interval * TIMER_FREQ);
+      block_print_io_stats ();
+    }
+}
+
+/* Starts printing I/O statistics every INTERVAL seconds while
+   the system runs. */
+void
+block_stats_start (int interval)
+{
+  ASSERT (interval > 0);
+  thread_create ("iostats", PRI_DEFAULT, block_stats_worker,
+                 (void *) interval);
+}
+
+/* Prints statistics for each block device used for a Pintos role,
+   then every device's I/O instrumentation. */
 void
 block_print_stats (void)
 {
@@ -171,11 +726,17 @@ block_print_stats (void)
       struct block *block = block_by_role[i];
       if (block != NULL)
         {
-          printf ("%s (%s): %llu reads, %llu writes\n",
+          printf ("%s (%s): %llu reads, %llu writes "
+                  "(%llu multi-sector reads, %llu multi-sector writes)\n",
                   block->name, block_type_name (block->type),
-                  block->read_cnt, block->write_cnt);
+                  block->read_cnt, block->write_cnt,
+                  block->read_multi_cnt, block->write_multi_cnt);
         }
     }
+  block_print_io_stats ();
+#ifdef P4FILESYS
+  free_map_print_stats ();
+#endif
 }
 
 /* Registers a new block device with the given NAME.  If
@@ -198,8 +759,24 @@ block_register (const char *name, enum block_type type,
   block->size = size;
   block->ops = ops;
   block->aux = aux;
+  lock_init (&block->queue_lock);
   block->read_cnt = 0;
   block->write_cnt = 0;
+  block->read_multi_cnt = 0;
+  block->write_multi_cnt = 0;
+  block->queued = false;
+  block->channel = NULL;
+  block->parent = NULL;
+  block->parent_start = 0;
+  memset (block->latency_hist, 0, sizeof block->latency_hist);
+  memset (block->service_hist, 0, sizeof block->service_hist);
+  block->request_cnt = 0;
+  block->seq_cnt = 0;
+  block->random_cnt = 0;
+  block->last_end = 0;
+  block->depth = 0;
+  block->max_depth = 0;
+  block->depth_sum = 0;
 
   printf ("%s: %'"PRDSNu" sectors (", block->name, block->size);
   print_human_readable_size ((uint64_t) block->size * BLOCK_SECTOR_SIZE);
@@ -2,7 +2,10 @@
 #define DEVICES_BLOCK_H
 
 #include <stddef.h>
+#include <stdbool.h>
 #include <inttypes.h>
+#include <list.h>
+#include "threads/synch.h"
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -53,11 +56,44 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_read_multi (struct block *, block_sector_t, size_t, void *);
+void block_write_multi (struct block *, block_sector_t, size_t,
+                        const void *);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
+/* An I/O request that the caller waits for separately.  The
+   caller owns the storage, which must stay valid until
+   block_wait() returns. */
+struct block_request
+  {
+    struct list_elem elem;              /* Element in queue. */
+    struct list_elem fifo_elem;         /* Element in fifo. */
+    block_sector_t sector;              /* First sector. */
+    size_t cnt;                         /* Number of sectors. */
+    void *buffer;                       /* Data to read or write. */
+    bool write;                         /* Write rather than read? */
+    int64_t deadline;                   /* Tick after which to dispatch
+                                           ahead of the elevator. */
+    uint64_t start;                     /* Time stamp counter at submit. */
+    struct semaphore done;              /* Up'd when the I/O completes. */
+  };
+
+/* Asynchronous operations. */
+void block_read_async (struct block *, block_sector_t, size_t,
+                       void *, struct block_request *);
+void block_write_async (struct block *, block_sector_t, size_t,
+                        const void *, struct block_request *);
+void block_wait (struct block_request *);
+
+/* I/O channels. */
+void block_set_channel (struct block *, const void *channel);
+const void *block_channel (struct block *);
+
 /* Statistics. */
 void block_print_stats (void);
+void block_print_io_stats (void);
+void block_stats_start (int interval);
 
 /* Lower-level interface to block device drivers. */
 
@@ -65,10 +101,21 @@ struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Optional: transfer CNT consecutive sectors at once.  If
+       null, block_read_multi() and block_write_multi() call
+       READ or WRITE once per sector. */
+    void (*read_multi) (void *aux, block_sector_t, size_t cnt,
+                        void *buffer);
+    void (*write_multi) (void *aux, block_sector_t, size_t cnt,
+                         const void *buffer);
   };
 
 struct block *block_register (const char *name, enum block_type,
                               const char *extra_info, block_sector_t size,
                               const struct block_operations *, void *aux);
+void block_queue_start (struct block *);
+void block_set_parent (struct block *, struct block *parent,
+                       block_sector_t start);
 
 #endif /* devices/block.h */
@@ -8,7 +8,9 @@
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
    controller.  It attempts to comply to [ATA-3]. */
@@ -34,6 +36,7 @@
 #define STA_BSY 0x80            /* Busy. */
 #define STA_DRDY 0x40           /* Device Ready. */
 #define STA_DRQ 0x08            /* Data Request. */
+#define STA_ERR 0x01            /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04           /* Software Reset. */
@@ -49,6 +52,48 @@
 #define CMD_IDENTIFY_DEVICE 0xec        /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20      /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30     /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4          /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5         /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6      /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA 0xc8               /* READ DMA. */
+#define CMD_WRITE_DMA 0xca              /* WRITE DMA. */
+
+/* Most sectors a single READ or WRITE command can transfer.
+   A sector count register value of 0 means 256. */
+#define MAX_TRANSFER 256
+
+/* PCI bus master IDE port addresses, relative to the channel's
+   bus master base (BAR4 of the IDE controller, plus 8 for the
+   secondary channel).  See [SFF-8038i]. */
+#define bm_command(CHANNEL) ((CHANNEL)->bm_base + 0)    /* Command. */
+#define bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)     /* Status. */
+#define bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)       /* PRD table. */
+
+/* Bus master Command Register bits. */
+#define BM_CMD_START 0x01       /* Start/stop bus master transfer. */
+#define BM_CMD_READ 0x08        /* Transfer from disk to memory. */
+
+/* Bus master Status Register bits. */
+#define BM_STA_ERR 0x02         /* Error, write 1 to clear. */
+#define BM_STA_INTR 0x04        /* Interrupt, write 1 to clear. */
+
+/* A physical region descriptor, one entry in the table that
+   tells the bus master which memory to transfer. */
+struct prd
+  {
+    uint32_t addr;              /* Physical address, must be even. */
+    uint16_t size;              /* Byte count, 0 means 64 kB. */
+    uint16_t flags;             /* PRD_EOT on the last entry. */
+  };
+#define PRD_EOT 0x8000          /* End of table. */
+
+/* PCI configuration space access ports. */
+#define PCI_CONFIG_ADDR 0xcf8
+#define PCI_CONFIG_DATA 0xcfc
+
+/* Use bus-master DMA on disks that support it?
+   PIO is used otherwise, or when DMA fails. */
+bool ide_dma = true;
 
 /* An ATA device. */
 struct ata_disk
@@ -57,6 +102,9 @@ struct ata_disk
     struct channel *channel;    /* Channel that disk is attached to. */
     int dev_no;                 /* Device 0 or 1 for master or slave. */
     bool is_ata;                /* Is device an ATA disk? */
+    int multiple;               /* Sectors per DRQ block for READ/WRITE
+                                   MULTIPLE, or 0 if not in use. */
+    bool dma;                   /* Transfer with bus-master DMA? */
   };
 
 /* An ATA channel (aka controller).
@@ -72,6 +120,9 @@ struct channel
                                    any interrupt would be spurious. */
     struct semaphore completion_wait;   /* Up'd by interrupt handler. */
 
+    uint16_t bm_base;           /* Bus master I/O port, or 0 if none. */
+    struct prd *prdt;           /* PRD table, one page. */
+
     struct ata_disk devices[2];     /* The devices on this channel. */
   };
 
@@ -84,8 +135,9 @@ static struct block_operations ide_operations;
 static void reset_channel (struct channel *);
 static bool check_device_type (struct ata_disk *);
 static void identify_ata_device (struct ata_disk *);
+static void set_multiple_mode (struct ata_disk *, const char *id);
 
-static void select_sector (struct ata_disk *, block_sector_t);
+static void select_sector (struct ata_disk *, block_sector_t, size_t);
 static void issue_pio_command (struct channel *, uint8_t command);
 static void input_sector (struct channel *, void *);
 static void output_sector (struct channel *, const void *);
@@ -95,12 +147,17 @@ static bool wait_while_busy (const struct ata_disk *);
 static void select_device (const struct ata_disk *);
 static void select_device_wait (const struct ata_disk *);
 
+static uint16_t find_bus_master (void);
+static bool dma_transfer (struct ata_disk *, block_sector_t, size_t,
+                          const void *, bool write);
+
 static void interrupt_handler (struct intr_frame *);
 
 /* Initialize the disk subsystem and detect disks. */
 void
 ide_init (void) 
 {
+  uint16_t bm_base = ide_dma ? find_bus_master () : 0;
   size_t chan_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++)
@@ -126,6 +183,14 @@ ide_init (void)
       lock_init (&c->lock);
       c->expecting_interrupt = false;
       sema_init (&c->completion_wait, 0);
+      c->bm_base = 0;
+      c->prdt = NULL;
+      if (bm_base != 0)
+        {
+          c->prdt = palloc_get_page (0);
+          if (c->prdt != NULL)
+            c->bm_base = bm_base + 8 * chan_no;
+        }
  
       /* Initialize devices. */
       for (dev_no = 0; dev_no < 2; dev_no++)
@@ -136,6 +201,8 @@ ide_init (void)
           d->channel = c;
           d->dev_no = dev_no;
           d->is_ata = false;
+          d->multiple = 0;
+          d->dma = false;
         }
 
       /* Register interrupt handler. */
@@ -303,12 +370,53 @@ identify_ata_device (struct ata_disk *d)
       return;
     }
 
+  set_multiple_mode (d, id);
+
+  /* Word 49 bit 8 says whether the disk can do DMA at all. */
+  d->dma = c->bm_base != 0 && (*(uint16_t *) &id[49 * 2] & 0x100) != 0;
+  if (d->dma)
+    printf ("%s: using bus-master DMA\n", d->name);
+
   /* Register. */
   block = block_register (d->name, BLOCK_RAW, extra_info, capacity,
                           &ide_operations, d);
+  block_set_channel (block, c);
+  block_queue_start (block);
   partition_scan (block);
 }
 
+/* Enables READ/WRITE MULTIPLE on disk D, using the largest DRQ
+   block size advertised in word 47 of its IDENTIFY DEVICE
+   response ID.  Leaves D->multiple at 0, so that transfers fall
+   back to one interrupt per sector, if the disk does not support
+   it or rejects the command. */
+static void
+set_multiple_mode (struct ata_disk *d, const char *id)
+{
+  struct channel *c = d->channel;
+  int max = *(const uint16_t *) &id[47 * 2] & 0xff;
+  int cnt;
+
+  if (max < 2)
+    return;
+
+  /* The block size must be a power of two. */
+  for (cnt = 1; cnt * 2 <= max; cnt *= 2)
+    continue;
+
+  select_device_wait (d);
+  outb (reg_nsect (c), cnt);
+  issue_pio_command (c, CMD_SET_MULTIPLE_MODE);
+  sema_down (&c->completion_wait);
+  wait_while_busy (d);
+  if (inb (reg_status (c)) & STA_ERR)
+    {
+      printf ("%s: SET MULTIPLE MODE rejected\n", d->name);
+      return;
+    }
+  d->multiple = cnt;
+}
+
 /* Translates STRING, which consists of SIZE bytes in a funky
    format, into a null-terminated string in-place.  Drops
    trailing whitespace and null bytes.  Returns STRING.  */
@@ -337,63 +445,156 @@ descramble_ata_string (char *string, int size)
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
+/* Reads CNT sectors, at most MAX_TRANSFER, starting at SEC_NO
+   from disk D into BUFFER in PIO mode.  The disk interrupts once
+   per DRQ block: every D->multiple sectors with READ MULTIPLE,
+   otherwise every sector.  D's channel must be locked. */
+static void
+pio_read (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+          void *buffer)
+{
+  struct channel *c = d->channel;
+  size_t step = d->multiple > 0 ? (size_t) d->multiple : 1;
+  uint8_t *p = buffer;
+  size_t done = 0;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, d->multiple > 0 ? CMD_READ_MULTIPLE
+                                        : CMD_READ_SECTOR_RETRY);
+  while (done < cnt)
+    {
+      size_t blk = cnt - done < step ? cnt - done : step;
+
+      sema_down (&c->completion_wait);
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk read failed, sector=%"PRDSNu,
+               d->name, sec_no + done);
+      for (; blk > 0; blk--, done++, p += BLOCK_SECTOR_SIZE)
+        input_sector (c, p);
+    }
+}
+
+/* Writes CNT sectors, at most MAX_TRANSFER, starting at SEC_NO
+   to disk D from BUFFER in PIO mode, as pio_read() does.  D's
+   channel must be locked. */
+static void
+pio_write (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+           const void *buffer)
+{
+  struct channel *c = d->channel;
+  size_t step = d->multiple > 0 ? (size_t) d->multiple : 1;
+  const uint8_t *p = buffer;
+  size_t done = 0;
+
+  select_sector (d, sec_no, cnt);
+  issue_pio_command (c, d->multiple > 0 ? CMD_WRITE_MULTIPLE
+                                        : CMD_WRITE_SECTOR_RETRY);
+  while (done < cnt)
+    {
+      size_t blk = cnt - done < step ? cnt - done : step;
+
+      if (!wait_while_busy (d))
+        PANIC ("%s: disk write failed, sector=%"PRDSNu,
+               d->name, sec_no + done);
+      for (; blk > 0; blk--, done++, p += BLOCK_SECTOR_SIZE)
+        output_sector (c, p);
+      sema_down (&c->completion_wait);
+    }
+}
+
+/* Reads CNT sectors starting at SEC_NO from disk D into BUFFER,
+   which must have room for CNT * BLOCK_SECTOR_SIZE bytes.
+   Each command moves up to MAX_TRANSFER sectors, by DMA if D
+   supports it and in PIO mode otherwise.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_read (void *d_, block_sector_t sec_no, void *buffer)
+ide_read_multi (void *d_, block_sector_t sec_no, size_t cnt, void *buffer)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  uint8_t *p = buffer;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_READ_SECTOR_RETRY);
-  sema_down (&c->completion_wait);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk read failed, sector=%"PRDSNu, d->name, sec_no);
-  input_sector (c, buffer);
+  while (cnt > 0)
+    {
+      size_t n = cnt < MAX_TRANSFER ? cnt : MAX_TRANSFER;
+
+      if (!d->dma || !dma_transfer (d, sec_no, n, p, false))
+        pio_read (d, sec_no, n, p);
+      sec_no += n;
+      cnt -= n;
+      p += n * BLOCK_SECTOR_SIZE;
+    }
   lock_release (&c->lock);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
+/* Reads sector SEC_NO from disk D into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes. */
+static void
+ide_read (void *d_, block_sector_t sec_no, void *buffer)
+{
+  ide_read_multi (d_, sec_no, 1, buffer);
+}
+
+/* Writes CNT sectors starting at SEC_NO to disk D from BUFFER,
+   which must contain CNT * BLOCK_SECTOR_SIZE bytes.  Returns
+   after the disk has acknowledged receiving the data.  Commands
+   are split as in ide_read_multi().
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
 static void
-ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+ide_write_multi (void *d_, block_sector_t sec_no, size_t cnt,
+                 const void *buffer)
 {
   struct ata_disk *d = d_;
   struct channel *c = d->channel;
+  const uint8_t *p = buffer;
+
   lock_acquire (&c->lock);
-  select_sector (d, sec_no);
-  issue_pio_command (c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy (d))
-    PANIC ("%s: disk write failed, sector=%"PRDSNu, d->name, sec_no);
-  output_sector (c, buffer);
-  sema_down (&c->completion_wait);
+  while (cnt > 0)
+    {
+      size_t n = cnt < MAX_TRANSFER ? cnt : MAX_TRANSFER;
+
+      if (!d->dma || !dma_transfer (d, sec_no, n, p, true))
+        pio_write (d, sec_no, n, p);
+      sec_no += n;
+      cnt -= n;
+      p += n * BLOCK_SECTOR_SIZE;
+    }
   lock_release (&c->lock);
 }
 
+/* Write sector SEC_NO to disk D from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
+   acknowledged receiving the data. */
+static void
+ide_write (void *d_, block_sector_t sec_no, const void *buffer)
+{
+  ide_write_multi (d_, sec_no, 1, buffer);
+}
+
 static struct block_operations ide_operations =
   {
     ide_read,
-    ide_write
+    ide_write,
+    ide_read_multi,
+    ide_write_multi
   };
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
+   writes SEC_NO and the count CNT to the disk's sector selection
+   registers.  (We use LBA mode.) */
 static void
-select_sector (struct ata_disk *d, block_sector_t sec_no)
+select_sector (struct ata_disk *d, block_sector_t sec_no, size_t cnt)
 {
   struct channel *c = d->channel;
 
-  ASSERT (sec_no < (1UL << 28));
+  ASSERT (cnt > 0 && cnt <= MAX_TRANSFER);
+  ASSERT (sec_no + cnt <= (1UL << 28));
   
   select_device_wait (d);
-  outb (reg_nsect (c), 1);
+  outb (reg_nsect (c), cnt == MAX_TRANSFER ? 0 : cnt);
   outb (reg_lbal (c), sec_no);
   outb (reg_lbam (c), sec_no >> 8);
   outb (reg_lbah (c), (sec_no >> 16));
@@ -414,6 +615,122 @@ issue_pio_command (struct channel *c, uint8_t command)
   outb (reg_command (c), command);
 }
 
+/* Bus-master DMA. */
+
+/* Reads the 32-bit register REG from the configuration space of
+   PCI function FUNC of device DEV on bus 0. */
+static uint32_t
+pci_read_config (int dev, int func, int reg)
+{
+  outl (PCI_CONFIG_ADDR, 0x80000000 | (dev << 11) | (func << 8) | reg);
+  return inl (PCI_CONFIG_DATA);
+}
+
+/* Writes VALUE to the 32-bit configuration register REG of PCI
+   function FUNC of device DEV on bus 0. */
+static void
+pci_write_config (int dev, int func, int reg, uint32_t value)
+{
+  outl (PCI_CONFIG_ADDR, 0x80000000 | (dev << 11) | (func << 8) | reg);
+  outl (PCI_CONFIG_DATA, value);
+}
+
+/* Looks on PCI bus 0 for an IDE controller that drives the
+   legacy channels and can act as bus master, such as the PIIX
+   that QEMU and Bochs emulate.  Enables bus mastering on it and
+   returns its bus master I/O port base, or 0 if there is none. */
+static uint16_t
+find_bus_master (void)
+{
+  int dev, func;
+
+  for (dev = 0; dev < 32; dev++)
+    for (func = 0; func < 8; func++)
+      {
+        uint32_t class, bar;
+
+        if ((pci_read_config (dev, func, 0x00) & 0xffff) == 0xffff)
+          continue;
+
+        /* Mass storage, IDE, bus master capable, both channels in
+           compatibility mode. */
+        class = pci_read_config (dev, func, 0x08) >> 8;
+        if ((class >> 8) != 0x0101 || (class & 0x85) != 0x80)
+          continue;
+
+        bar = pci_read_config (dev, func, 0x20);
+        if ((bar & 1) == 0 || (bar & 0xfffc) == 0)
+          continue;
+
+        /* Enable I/O space and bus mastering. */
+        pci_write_config (dev, func, 0x04,
+                          (pci_read_config (dev, func, 0x04) & 0xffff)
+                          | 0x05);
+        printf ("ide: bus master at port %#x\n", bar & 0xfffc);
+        return bar & 0xfffc;
+      }
+  return 0;
+}
+
+/* Transfers CNT sectors, at most MAX_TRANSFER, starting at SEC_NO
+   between disk D and BUFFER by bus-master DMA, writing to the
+   disk if WRITE is true.  The thread sleeps while the controller
+   moves the data.  D's channel must be locked.
+
+   Returns true if successful.  On failure turns off DMA for D,
+   so that the caller and all later transfers use PIO. */
+static bool
+dma_transfer (struct ata_disk *d, block_sector_t sec_no, size_t cnt,
+              const void *buffer, bool write)
+{
+  struct channel *c = d->channel;
+  uint8_t command = write ? 0 : BM_CMD_READ;
+  const uint8_t *p = buffer;
+  size_t left = cnt * BLOCK_SECTOR_SIZE;
+  struct prd *e = c->prdt;
+  uint8_t status;
+
+  /* The bus master can only address even physical addresses. */
+  if ((uintptr_t) buffer & 1)
+    return false;
+
+  /* One descriptor per physical page touched, so that no entry
+     crosses a 64 kB boundary. */
+  while (left > 0)
+    {
+      size_t n = PGSIZE - pg_ofs (p);
+      if (n > left)
+        n = left;
+      e->addr = vtop (p);
+      e->size = n;
+      e->flags = 0;
+      e++;
+      p += n;
+      left -= n;
+    }
+  e[-1].flags = PRD_EOT;
+
+  select_sector (d, sec_no, cnt);
+  outl (bm_prdt (c), vtop (c->prdt));
+  outb (bm_command (c), command);
+  outb (bm_status (c), inb (bm_status (c)) | BM_STA_ERR | BM_STA_INTR);
+  issue_pio_command (c, write ? CMD_WRITE_DMA : CMD_READ_DMA);
+  outb (bm_command (c), command | BM_CMD_START);
+  sema_down (&c->completion_wait);
+  outb (bm_command (c), command);
+
+  status = inb (bm_status (c));
+  outb (bm_status (c), status | BM_STA_ERR | BM_STA_INTR);
+  if ((status & BM_STA_ERR) || (inb (reg_alt_status (c)) & STA_ERR))
+    {
+      printf ("%s: DMA %s failed, sector=%"PRDSNu", using PIO\n",
+              d->name, write ? "write" : "read", sec_no);
+      d->dma = false;
+      return false;
+    }
+  return true;
+}
+
 /* Reads a sector from channel C's data register in PIO mode into
    SECTOR, which must have room for BLOCK_SECTOR_SIZE bytes. */
 static void
@@ -169,6 +169,7 @@ found_partition (struct block *block, uint8_t part_type,
                               : part_type == 0x23 ? BLOCK_SWAP
                               : BLOCK_FOREIGN);
       struct partition *p;
+      struct block *part;
       char extra_info[128];
       char name[16];
 
@@ -181,7 +182,10 @@ found_partition (struct block *block, uint8_t part_type,
       snprintf (name, sizeof name, "%s%d", block_name (block), part_nr);
       snprintf (extra_info, sizeof extra_info, "%s (%02x)",
                 partition_type_name (part_type), part_type);
-      block_register (name, type, extra_info, size, &partition_operations, p);
+      part = block_register (name, type, extra_info, size,
+                             &partition_operations, p);
+      block_set_channel (part, block_channel (block));
+      block_set_parent (part, block, start);
     }
 }
 
@@ -317,8 +321,12 @@ partition_write (void *p_, block_sector_t sector, const void *buffer)
   block_write (p->block, p->start + sector, buffer);
 }
 
+/* Partitions forward their requests to the underlying device, see
+   block_set_parent(), so they have no multi-sector operations. */
 static struct block_operations partition_operations =
   {
     partition_read,
-    partition_write
+    partition_write,
+    NULL,
+    NULL
   };
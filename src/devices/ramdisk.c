@@ -0,0 +1,117 @@
+#include "devices/ramdisk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/block.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* A block device kept in kernel memory.  It has no seek or
+   transfer latency, so it shows what the kernel's own I/O paths
+   cost.  Its contents are lost at power off. */
+
+/* Sectors per page of backing memory. */
+#define SECTORS_PER_PAGE (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* A RAM disk. */
+struct ramdisk
+  {
+    void **pages;               /* Backing pages, zeroed at start. */
+    size_t page_cnt;            /* Number of pages. */
+  };
+
+static struct ramdisk ramdisk;
+
+static struct block_operations ramdisk_operations;
+
+/* Creates a RAM disk named "ram0" of KB kilobytes, rounded up to
+   a whole number of pages, and registers it as a raw block
+   device.  It can then be given any role by name, e.g.
+   -filesys=ram0 or -swap=ram0.  Does nothing if KB is 0. */
+void
+ramdisk_init (size_t kb)
+{
+  size_t i;
+
+  if (kb == 0)
+    return;
+
+  ramdisk.page_cnt = DIV_ROUND_UP (kb * 1024, PGSIZE);
+  ramdisk.pages = malloc (ramdisk.page_cnt * sizeof *ramdisk.pages);
+  if (ramdisk.pages == NULL)
+    PANIC ("ram0: out of memory");
+
+  /* The pages need not be contiguous, so allocate them one at a
+     time. */
+  for (i = 0; i < ramdisk.page_cnt; i++)
+    {
+      ramdisk.pages[i] = palloc_get_page (PAL_ZERO);
+      if (ramdisk.pages[i] == NULL)
+        PANIC ("ram0: out of memory after %zu of %zu kB",
+               i * PGSIZE / 1024, ramdisk.page_cnt * PGSIZE / 1024);
+    }
+
+  block_register ("ram0", BLOCK_RAW, "RAM disk",
+                  ramdisk.page_cnt * SECTORS_PER_PAGE,
+                  &ramdisk_operations, &ramdisk);
+}
+
+/* Returns the address of sector SEC_NO of RAM disk RD. */
+static uint8_t *
+sector_address (const struct ramdisk *rd, block_sector_t sec_no)
+{
+  ASSERT (sec_no / SECTORS_PER_PAGE < rd->page_cnt);
+  return ((uint8_t *) rd->pages[sec_no / SECTORS_PER_PAGE]
+          + sec_no % SECTORS_PER_PAGE * BLOCK_SECTOR_SIZE);
+}
+
+/* Reads CNT sectors starting at SEC_NO from RAM disk RD_ into
+   BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes. */
+static void
+ramdisk_read_multi (void *rd_, block_sector_t sec_no, size_t cnt,
+                    void *buffer)
+{
+  const struct ramdisk *rd = rd_;
+  uint8_t *p = buffer;
+
+  for (; cnt > 0; cnt--, sec_no++, p += BLOCK_SECTOR_SIZE)
+    memcpy (p, sector_address (rd, sec_no), BLOCK_SECTOR_SIZE);
+}
+
+/* Writes CNT sectors starting at SEC_NO to RAM disk RD_ from
+   BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes. */
+static void
+ramdisk_write_multi (void *rd_, block_sector_t sec_no, size_t cnt,
+                     const void *buffer)
+{
+  const struct ramdisk *rd = rd_;
+  const uint8_t *p = buffer;
+
+  for (; cnt > 0; cnt--, sec_no++, p += BLOCK_SECTOR_SIZE)
+    memcpy (sector_address (rd, sec_no), p, BLOCK_SECTOR_SIZE);
+}
+
+/* Reads sector SEC_NO from RAM disk RD_ into BUFFER. */
+static void
+ramdisk_read (void *rd_, block_sector_t sec_no, void *buffer)
+{
+  ramdisk_read_multi (rd_, sec_no, 1, buffer);
+}
+
+/* Writes sector SEC_NO to RAM disk RD_ from BUFFER. */
+static void
+ramdisk_write (void *rd_, block_sector_t sec_no, const void *buffer)
+{
+  ramdisk_write_multi (rd_, sec_no, 1, buffer);
+}
+
+static struct block_operations ramdisk_operations =
+  {
+    ramdisk_read,
+    ramdisk_write,
+    ramdisk_read_multi,
+    ramdisk_write_multi
+  };
@@ -12,6 +12,10 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "filesys/filesys.h"
+#include "filesys/journal.h"
+#endif
+#ifdef VM
+#include "vm/frame.h"
 #endif
 
 /* Keyboard control register port. */
@@ -21,6 +25,7 @@
 static enum shutdown_type how = SHUTDOWN_NONE;
 
 static void print_stats (void);
+static void power_off (void) NO_RETURN;
 
 /* Shuts down the machine in the way configured by
    shutdown_configure().  If the shutdown type is SHUTDOWN_NONE
@@ -87,13 +92,29 @@ shutdown_reboot (void)
 void
 shutdown_power_off (void)
 {
-  const char s[] = "Shutdown";
-  const char *p;
-
 #ifdef FILESYS
   filesys_done ();
 #endif
 
+  power_off ();
+}
+
+/* Powers down the machine at once, without writing back any file
+   system data, as if the power had failed.  Used to test crash
+   recovery. */
+void
+shutdown_crash (void)
+{
+  power_off ();
+}
+
+/* Prints statistics and powers down the machine. */
+static void
+power_off (void)
+{
+  const char s[] = "Shutdown";
+  const char *p;
+
   print_stats ();
 
   printf ("Powering off...\n");
@@ -130,10 +151,17 @@ print_stats (void)
   thread_print_stats ();
 #ifdef FILESYS
   block_print_stats ();
+#endif
+#ifdef P4FILESYS
+  buffer_print_stats ();
+  journal_print_stats ();
 #endif
   console_print_stats ();
   kbd_print_stats ();
 #ifdef USERPROG
   exception_print_stats ();
 #endif
+#ifdef VM
+  VM_print_stats ();
+#endif
 }
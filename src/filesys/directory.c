@@ -2,9 +2,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <list.h>
+#include <hash.h>
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
+#include "threads/synch.h"
 
 /* A directory. */
 struct dir
@@ -21,6 +23,54 @@ struct dir_entry
 	bool in_use; /* In use or free? */
 };
 
+#ifdef P4FILESYS
+/* Directories start out as a linear array of entries.  Once one
+ fills up past DIR_HASH_MIN entries it is rebuilt as an open
+ addressing hash table on the entry names: the entry for a name
+ is at or after slot hash_string(name) % capacity, probing
+ linearly.  The entry format is unchanged, so dir_readdir() works
+ on both.  A slot never used has an empty name and ends a probe
+ sequence; a removed entry keeps its name as a tombstone.
+ inode_data[HASH] counts the slots in use or tombstoned.  Before
+ they would fill three quarters of the table it is rebuilt,
+ dropping the tombstones, and doubled only if the live entries
+ alone would fill that much. */
+#define DIR_HASH_MIN 32
+
+static bool hashed_lookup(const struct dir *dir, const char *name,
+		struct dir_entry *ep, off_t *ofsp, off_t *freep);
+static bool hashed_rebuild(struct dir *dir, size_t capacity);
+
+/* Dentry cache: the result of recent lookups, keyed by directory
+ inode sector and name, so resolving a path that was resolved
+ before reads no directory at all.  Negative results are kept
+ too.  dir_add() and dir_remove() keep it up to date.  Bounded to
+ DENTRY_MAX entries, evicting the least recently used. */
+#define DENTRY_MAX 128
+
+struct dentry
+{
+	block_sector_t parent; /* Sector of the directory's inode. */
+	char name[NAME_MAX + 1];
+	block_sector_t inode_sector; /* 0 if NAME does not exist. */
+	struct hash_elem hash_elem;
+	struct list_elem lru_elem;
+};
+
+static struct hash dentry_hash;
+static struct list dentry_lru; /* Least recently used first. */
+static struct lock dentry_lock;
+
+static bool dentry_find(block_sector_t parent, const char *name,
+		block_sector_t *sectorp);
+static void dentry_set(block_sector_t parent, const char *name,
+		block_sector_t sector);
+static void dentry_purge(block_sector_t parent);
+static unsigned dentry_hash_func(const struct hash_elem *e, void *aux);
+static bool dentry_less(const struct hash_elem *a, const struct hash_elem *b,
+		void *aux);
+#endif
+
 /* Creates a directory with space for ENTRY_CNT entries in the
  given SECTOR.  Returns true if successful, false on failure. */
 bool dir_create(block_sector_t sector, size_t entry_cnt)
@@ -99,6 +149,10 @@ static bool lookup(const struct dir *dir, const char *name,
 	ASSERT(dir != NULL);
 	ASSERT(name != NULL);
 
+#ifdef P4FILESYS
+	if (dir->inode->inode_data[HASH])
+		return hashed_lookup(dir, name, ep, ofsp, NULL);
+#endif
 	for (ofs = 0; inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
 			ofs += sizeof e)
 		if (e.in_use && !strcmp(name, e.name))
@@ -123,10 +177,31 @@ bool dir_lookup(const struct dir *dir, const char *name, struct inode **inode)
 	ASSERT(dir != NULL);
 	ASSERT(name != NULL);
 
+#ifdef P4FILESYS
+	block_sector_t parent = inode_get_inumber(dir->inode);
+	block_sector_t sector;
+
+	if (dentry_find(parent, name, &sector))
+	{
+		*inode = sector != 0 ? inode_open(sector) : NULL;
+		return *inode != NULL;
+	}
 	if (lookup(dir, name, &e, NULL))
+	{
+		dentry_set(parent, name, e.inode_sector);
 		*inode = inode_open(e.inode_sector);
+	}
 	else
+	{
+		dentry_set(parent, name, 0);
 		*inode = NULL;
+	}
+#else
+	if (lookup(dir, name, &e, NULL))
+		*inode = inode_open(e.inode_sector);
+	else
+		*inode = NULL;
+#endif
 
 	return *inode != NULL;
 }
@@ -156,6 +231,22 @@ bool dir_add(struct dir *dir, const char *name, block_sector_t inode_sector)
 
 #ifdef P4FILESYS
 	dir_op(DIROP_ADDPAR, dir, NULL, inode_sector);
+
+	if (dir->inode->inode_data[HASH])
+	{
+		size_t capacity = inode_length(dir->inode) / sizeof e;
+		if ((dir->inode->inode_data[HASH] + 1) * 4 > capacity * 3
+				&& !hashed_rebuild(dir, capacity))
+			goto done;
+		hashed_lookup(dir, name, NULL, NULL, &ofs);
+		inode_read_at(dir->inode, &e, sizeof e, ofs);
+		if (e.name[0] == '\0')
+		{
+			dir->inode->inode_data[HASH]++;
+			dir->inode->dirty = true;
+		}
+		goto write;
+	}
 #endif
 
 	/* Set OFS to offset of free slot.
@@ -170,11 +261,29 @@ bool dir_add(struct dir *dir, const char *name, block_sector_t inode_sector)
 		if (!e.in_use)
 			break;
 
+#ifdef P4FILESYS
+	//a full directory past the threshold becomes a hash table
+	if (ofs == inode_length(dir->inode)
+			&& ofs / (off_t) sizeof e >= DIR_HASH_MIN)
+	{
+		if (!hashed_rebuild(dir, ofs / sizeof e * 2))
+			goto done;
+		hashed_lookup(dir, name, NULL, NULL, &ofs);
+		dir->inode->inode_data[HASH]++;
+		dir->inode->dirty = true;
+	}
+
+	write:
+#endif
 	/* Write slot. */
 	e.in_use = true;
 	strlcpy(e.name, name, sizeof e.name);
 	e.inode_sector = inode_sector;
 	success = inode_write_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
+#ifdef P4FILESYS
+	if (success)
+		dentry_set(inode_get_inumber(dir->inode), name, inode_sector);
+#endif
 
 	done: return success;
 }
@@ -212,6 +321,13 @@ bool dir_remove(struct dir *dir, const char *name)
 	if (inode_write_at(dir->inode, &e, sizeof e, ofs) != sizeof e)
 		goto done;
 
+#ifdef P4FILESYS
+	dentry_set(inode_get_inumber(dir->inode), name, 0);
+	//its sector may become a new directory with other entries
+	if (inode_op(OP_ISDIR, inode))
+		dentry_purge(e.inode_sector);
+#endif
+
 	/* Remove inode. */
 	inode_remove(inode);
 	success = true;
@@ -276,6 +392,7 @@ bool dir_op(int choice, struct dir *dir, struct inode **inode,
 		if (inode)
 		{
 			inode->inode_data[PAR] = inode_get_inumber(dir_get_inode(dir));
+			inode->dirty = true;
 			inode_close(inode);
 			success = true;
 		}
@@ -284,6 +401,200 @@ bool dir_op(int choice, struct dir *dir, struct inode **inode,
 	return false;
 }
 
+/* Probes hashed directory DIR for NAME.  If found, returns true
+ and sets *EP and *OFSP as lookup() does.  Otherwise returns false
+ and, if FREEP is non-null, sets *FREEP to the offset of the slot
+ a new entry for NAME belongs in: the first tombstone or unused
+ slot on its probe sequence. */
+static bool hashed_lookup(const struct dir *dir, const char *name,
+		struct dir_entry *ep, off_t *ofsp, off_t *freep)
+{
+	struct dir_entry e;
+	size_t capacity = inode_length(dir->inode) / sizeof e;
+	size_t slot = hash_string(name) % capacity;
+	off_t free_ofs = -1;
+
+	for (size_t i = 0; i < capacity; i++, slot = (slot + 1) % capacity)
+	{
+		off_t ofs = slot * sizeof e;
+		if (inode_read_at(dir->inode, &e, sizeof e, ofs) != sizeof e)
+			break;
+		if (e.in_use)
+		{
+			if (strcmp(name, e.name))
+				continue;
+			if (ep != NULL)
+				*ep = e;
+			if (ofsp != NULL)
+				*ofsp = ofs;
+			return true;
+		}
+		if (free_ofs == -1)
+			free_ofs = ofs;
+		if (e.name[0] == '\0')
+			break;
+	}
+	if (freep != NULL)
+		*freep = free_ofs;
+	return false;
+}
+
+/* Rewrites the entries of DIR as a hash table of at least CAPACITY
+ slots, dropping tombstones.  CAPACITY must be at least the number
+ of slots DIR has now; it is doubled until one more live entry
+ would leave the table under three quarters full.  Returns false
+ if out of memory or on a disk error. */
+static bool hashed_rebuild(struct dir *dir, size_t capacity)
+{
+	struct dir_entry e;
+	struct dir_entry *table;
+	size_t live = 0;
+	off_t ofs;
+	bool success;
+
+	for (ofs = 0; inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
+			ofs += sizeof e)
+		if (e.in_use)
+			live++;
+	while ((live + 1) * 4 > capacity * 3)
+		capacity *= 2;
+
+	table = calloc(capacity, sizeof *table);
+	if (table == NULL)
+		return false;
+	for (ofs = 0; inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
+			ofs += sizeof e)
+		if (e.in_use)
+		{
+			size_t slot = hash_string(e.name) % capacity;
+			while (table[slot].in_use)
+				slot = (slot + 1) % capacity;
+			table[slot] = e;
+		}
+
+	success = inode_write_at(dir->inode, table, capacity * sizeof *table, 0)
+			== (off_t) (capacity * sizeof *table);
+	if (success)
+	{
+		dir->inode->inode_data[HASH] = live;
+		dir->inode->dirty = true;
+	}
+	free(table);
+	return success;
+}
+
+/* Initializes the dentry cache. */
+void dentry_init(void)
+{
+	hash_init(&dentry_hash, dentry_hash_func, dentry_less, NULL);
+	list_init(&dentry_lru);
+	lock_init(&dentry_lock);
+}
+
+/* Returns the dentry for NAME in the directory whose inode is at
+ PARENT, or a null pointer.  The caller must hold dentry_lock. */
+static struct dentry *dentry_lookup(block_sector_t parent, const char *name)
+{
+	struct dentry key;
+	struct hash_elem *e;
+
+	key.parent = parent;
+	strlcpy(key.name, name, sizeof key.name);
+	e = hash_find(&dentry_hash, &key.hash_elem);
+	return e != NULL ? hash_entry(e, struct dentry, hash_elem) : NULL;
+}
+
+/* Looks up NAME in the directory whose inode is at PARENT.  If it
+ is cached, returns true and sets *SECTORP to its inode sector,
+ or to 0 if NAME is known not to exist. */
+static bool dentry_find(block_sector_t parent, const char *name,
+		block_sector_t *sectorp)
+{
+	struct dentry *d;
+
+	if (strlen(name) > NAME_MAX)
+		return false;
+	lock_acquire(&dentry_lock);
+	d = dentry_lookup(parent, name);
+	if (d != NULL)
+	{
+		*sectorp = d->inode_sector;
+		list_remove(&d->lru_elem);
+		list_push_back(&dentry_lru, &d->lru_elem);
+	}
+	lock_release(&dentry_lock);
+	return d != NULL;
+}
+
+/* Records that NAME in the directory whose inode is at PARENT has
+ its inode at SECTOR, or does not exist if SECTOR is 0. */
+static void dentry_set(block_sector_t parent, const char *name,
+		block_sector_t sector)
+{
+	struct dentry *d;
+
+	if (strlen(name) > NAME_MAX)
+		return;
+	lock_acquire(&dentry_lock);
+	d = dentry_lookup(parent, name);
+	if (d != NULL)
+		list_remove(&d->lru_elem);
+	else if (hash_size(&dentry_hash) >= DENTRY_MAX)
+	{
+		d = list_entry(list_pop_front(&dentry_lru), struct dentry, lru_elem);
+		hash_delete(&dentry_hash, &d->hash_elem);
+	}
+	else
+		d = malloc(sizeof *d);
+
+	if (d != NULL)
+	{
+		d->parent = parent;
+		strlcpy(d->name, name, sizeof d->name);
+		d->inode_sector = sector;
+		hash_replace(&dentry_hash, &d->hash_elem);
+		list_push_back(&dentry_lru, &d->lru_elem);
+	}
+	lock_release(&dentry_lock);
+}
+
+/* Drops every cached entry of the directory whose inode is at
+ PARENT. */
+static void dentry_purge(block_sector_t parent)
+{
+	struct list_elem *e, *next;
+
+	lock_acquire(&dentry_lock);
+	for (e = list_begin(&dentry_lru); e != list_end(&dentry_lru); e = next)
+	{
+		struct dentry *d = list_entry(e, struct dentry, lru_elem);
+		next = list_next(e);
+		if (d->parent == parent)
+		{
+			list_remove(&d->lru_elem);
+			hash_delete(&dentry_hash, &d->hash_elem);
+			free(d);
+		}
+	}
+	lock_release(&dentry_lock);
+}
+
+static unsigned dentry_hash_func(const struct hash_elem *e, void *aux UNUSED)
+{
+	const struct dentry *d = hash_entry(e, struct dentry, hash_elem);
+	return hash_string(d->name) ^ hash_int(d->parent);
+}
+
+static bool dentry_less(const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED)
+{
+	const struct dentry *x = hash_entry(a, struct dentry, hash_elem);
+	const struct dentry *y = hash_entry(b, struct dentry, hash_elem);
+	if (x->parent != y->parent)
+		return x->parent < y->parent;
+	return strcmp(x->name, y->name) < 0;
+}
+
 bool dir_remove_validate(struct inode *inode)
 {
 	//if i am looking at a directory and
@@ -36,6 +36,7 @@ bool dir_readdir(struct dir *, char name[NAME_MAX + 1]);
 bool dir_op(int choice, struct dir *dir, struct inode **inode,
 		block_sector_t sector);
 bool dir_remove_validate(struct inode *inode);
+void dentry_init(void);
 #endif
 
 #endif /* filesys/directory.h */
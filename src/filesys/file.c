@@ -9,6 +9,9 @@ struct file
 	struct inode *inode; /* File's inode. */
 	off_t pos; /* Current position. */
 	bool deny_write; /* Has file_deny_write() been called? */
+#ifdef P4FILESYS
+	off_t last_pos; /* Where the previous file_read() ended. */
+#endif
 };
 
 /* Opens a file for the given INODE, of which it takes ownership,
@@ -23,6 +26,9 @@ file_open(struct inode *inode)
 		file->inode = inode;
 		file->pos = 0;
 		file->deny_write = false;
+#ifdef P4FILESYS
+		file->last_pos = 0;
+#endif
 		return file;
 	}
 	else
@@ -63,11 +69,21 @@ file_get_inode(struct file *file)
  starting at the file's current position.
  Returns the number of bytes actually read,
  which may be less than SIZE if end of file is reached.
- Advances FILE's position by the number of bytes read. */
+ Advances FILE's position by the number of bytes read.
+ A read that starts where the previous one ended is treated as
+ sequential and the sectors after it are read ahead. */
 off_t file_read(struct file *file, void *buffer, off_t size)
 {
 	off_t bytes_read = inode_read_at(file->inode, buffer, size, file->pos);
+#ifdef P4FILESYS
+	bool sequential = file->pos == file->last_pos;
+#endif
 	file->pos += bytes_read;
+#ifdef P4FILESYS
+	if (sequential && bytes_read > 0)
+		inode_read_ahead(file->inode, file->pos);
+	file->last_pos = file->pos;
+#endif
 	return bytes_read;
 }
 
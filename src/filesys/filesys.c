@@ -6,10 +6,13 @@
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
 #include "filesys/directory.h"
+#include "filesys/journal.h"
 
 #ifdef P4FILESYS
+#include <stdlib.h>
 #include "threads/thread.h"
 #include "threads/malloc.h"
+#include "devices/timer.h"
 #endif
 
 /* Partition that contains the file system. */
@@ -17,6 +20,87 @@ struct block *fs_device;
 
 static void do_format(void);
 
+#ifdef P4FILESYS
+/* Buffer cache entries indexed by sector. */
+static struct hash hash_buffer;
+
+/* Replacement segments, least recently used entry at the front.
+ Data enters SEG_A1 and is only promoted to SEG_AM when it is
+ missed again shortly after leaving SEG_A1, so a single large scan
+ cycles through SEG_A1 without disturbing SEG_AM or SEG_META. */
+#define A1_QUOTA (BUFFER_SIZE / 4)      /* Target size of SEG_A1. */
+#define META_QUOTA (BUFFER_SIZE / 4)    /* Most SEG_META may keep. */
+#define GHOST_SIZE (BUFFER_SIZE / 2)    /* Sectors remembered from SEG_A1. */
+static struct list list_segment[SEG_CNT];
+static uint32_t segment_size[SEG_CNT];
+
+/* Sectors recently evicted from SEG_A1 (the 2Q "A1out" queue). */
+struct ghost_struct
+{
+	uint32_t sector;
+	struct list_elem ghost_listelem;
+	struct hash_elem ghost_hashelem;
+};
+static struct list list_ghost;
+static struct hash hash_ghost;
+static uint32_t ghost_size;
+
+/* Signalled when some buffer cache entry loses its last pin. */
+static struct condition buffer_unpinned;
+//one buffer_flush() at a time, since each uses the whole journal
+static struct lock buffer_flush_lock;
+//entries that are both dirty and metadata, i.e. not yet committed;
+//protected by BUFFER_LOCK
+static size_t meta_dirty_cnt;
+
+/* Buffer cache statistics, per segment. */
+static unsigned long long segment_hits[SEG_CNT];
+static unsigned long long segment_misses[SEG_CNT];
+
+/* -ra: Sectors to read ahead of a sequential reader. */
+uint32_t readahead_window = READAHEAD_WINDOW;
+
+/* Sectors waiting for the read-ahead thread. */
+struct readahead_struct
+{
+	uint32_t sector;
+	struct list_elem readahead_listelem;
+};
+static struct list list_readahead;
+static struct lock readahead_lock;
+static struct semaphore readahead_sema;
+static uint32_t readahead_size;
+
+/* Read-ahead and write-behind threads, stopped by filesys_done()
+ before the cache is torn down.  Each ups its semaphore on exit. */
+static bool buffer_stopping;
+static tid_t readahead_tid;
+static tid_t flush_tid;
+static struct semaphore readahead_exit;
+static struct semaphore flush_exit;
+
+/* Read-ahead statistics. */
+static unsigned long long readahead_cnt; /* Sectors fetched ahead. */
+static unsigned long long readahead_hits; /* Of those, later used. */
+
+static unsigned buffer_hash(const struct hash_elem *b_, void *aux);
+static bool buffer_less_helper(const struct hash_elem *a_,
+		const struct hash_elem *b_, void *aux);
+static unsigned ghost_hash(const struct hash_elem *g_, void *aux);
+static bool ghost_less_helper(const struct hash_elem *a_,
+		const struct hash_elem *b_, void *aux);
+static struct buffer_struct* buffer_fetch(uint32_t sector, int type,
+		bool read);
+static struct buffer_struct* buffer_victim(void);
+static void buffer_ghost_add(uint32_t sector);
+static bool buffer_ghost_remove(uint32_t sector);
+static void buffer_readahead_worker(void *aux);
+static void buffer_flush_worker(void *aux);
+static int buffer_sector_compare(const void *a_, const void *b_);
+static void buffer_write_runs(const block_sector_t *sectors,
+		const uint8_t *copies, size_t cnt);
+#endif
+
 /* Initializes the file system module.
  If FORMAT is true, reformats the file system. */
 void filesys_init(bool format)
@@ -28,17 +112,60 @@ void filesys_init(bool format)
 	inode_init();
 
 #ifdef P4FILESYS
-	list_init(&list_buffer);
+	hash_init(&hash_buffer, buffer_hash, buffer_less_helper, NULL);
+	for (int i = 0; i < SEG_CNT; i++)
+	{
+		list_init(&list_segment[i]);
+		segment_size[i] = 0;
+	}
+	list_init(&list_ghost);
+	hash_init(&hash_ghost, ghost_hash, ghost_less_helper, NULL);
+	ghost_size = 0;
 	lock_init(&buffer_lock);
+	cond_init(&buffer_unpinned);
+	lock_init(&buffer_flush_lock);
 	buffer_size = 0;
+	meta_dirty_cnt = 0;
+	journal_init();
+
+	list_init(&list_readahead);
+	lock_init(&readahead_lock);
+	sema_init(&readahead_sema, 0);
+	readahead_size = 0;
+	buffer_stopping = false;
+	sema_init(&readahead_exit, 0);
+	sema_init(&flush_exit, 0);
+	readahead_tid = TID_ERROR;
+	if (readahead_window > 0)
+		readahead_tid = thread_create("read_ahead", PRI_DEFAULT,
+				buffer_readahead_worker, NULL);
+	flush_tid = thread_create("write_behind", PRI_DEFAULT,
+			buffer_flush_worker, NULL);
 #endif
 
+#ifdef P4FILESYS
+	if (!format)
+		journal_recover();
+#endif
 	free_map_init();
+#ifdef P4FILESYS
+	dentry_init();
+#endif
 
 	if (format)
 		do_format();
 
 	free_map_open();
+#ifdef P4FILESYS
+	//new files take the layout the file system was formatted with
+	if (!format)
+	{
+		journal_attach();
+		struct inode *inode = inode_open(FREE_MAP_SECTOR);
+		inode_format = inode_op(OP_FORMAT, inode);
+		inode_close(inode);
+	}
+#endif
 }
 
 /* Shuts down the file system module, writing any unwritten data
@@ -46,28 +173,47 @@ void filesys_init(bool format)
 void filesys_done(void)
 {
 #ifdef P4FILESYS
-	//before shutting down the filesys module, write all dirty data to disk
+	//the free map inode is written through the buffer cache, so close
+	//it first; then write all dirty data to disk.  the read-ahead and
+	//write-behind threads use the cache too, so stop them before that,
+	//unless this is one of them shutting down on a panic
 	struct buffer_struct *bc = NULL;
-	struct list_elem *e;
+	tid_t self = thread_current()->tid;
+	buffer_stopping = true;
+	if (readahead_tid != TID_ERROR && readahead_tid != self)
+	{
+		sema_up(&readahead_sema);
+		sema_down(&readahead_exit);
+	}
+	if (flush_tid != TID_ERROR && flush_tid != self)
+		sema_down(&flush_exit);
+	free_map_close();
+	journal_close();
+	buffer_flush();
 	lock_acquire(&buffer_lock);
-	for (e = list_begin(&list_buffer); e != list_end(&list_buffer); e =
-			list_next(e))
+	for (int i = 0; i < SEG_CNT; i++)
 	{
-		bc = list_entry(e, struct buffer_struct, buffer_listelem);
-		if (bc != NULL)
+		while (!list_empty(&list_segment[i]))
 		{
+			bc = list_entry(list_pop_front(&list_segment[i]),
+					struct buffer_struct, buffer_listelem);
 			if (bc->dirty)
 				block_write(fs_device, bc->sector, &bc->content);
+			free(bc);
 		}
-		else
-			PANIC("filesys_done: NULL value of buffer encountered");
-
-		list_remove(&bc->buffer_listelem);
+		segment_size[i] = 0;
 	}
-	free(bc);
+	hash_clear(&hash_buffer, NULL);
+	buffer_size = 0;
+	while (!list_empty(&list_ghost))
+		free(list_entry(list_pop_front(&list_ghost), struct ghost_struct,
+				ghost_listelem));
+	hash_clear(&hash_ghost, NULL);
+	ghost_size = 0;
 	lock_release(&buffer_lock);
-#endif
+#else
 	free_map_close();
+#endif
 }
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
@@ -105,11 +251,16 @@ bool filesys_create(const char *name, off_t initial_size, bool isdir)
 	if (!success && inode_sector != 0)
 	free_map_release (inode_sector, 1);
 #else
-	bool success = (dir != NULL && free_map_allocate(1, &inode_sector)
+	//new inodes go near their directory, and their data near them
+	journal_begin();
+	bool success = (dir != NULL
+			&& free_map_allocate_near(inode_get_inumber(dir_get_inode(dir)), 1,
+					&inode_sector)
 			&& inode_create(inode_sector, initial_size, !isdir)
 			&& dir_add(dir, file_name, inode_sector));
 	if (!success && inode_sector != 0)
 		free_map_release(inode_sector, 1);
+	journal_end();
 #endif
 	dir_close(dir);
 #ifdef P4FILESYS
@@ -212,9 +363,11 @@ bool filesys_remove(const char *name)
 	struct dir* dir = NULL;
 	filesys_inside_dir(&dir, name);
 	filesys_filename(&file_name, name);
+	journal_begin();
 	bool success = file_name != NULL && dir != NULL
 			&& dir_remove(dir, file_name);
 	dir_close(dir);
+	journal_end();
 	free(file_name);
 	return success;
 #endif
@@ -224,6 +377,9 @@ bool filesys_remove(const char *name)
 static void do_format(void)
 {
 	printf("Formatting file system...");
+#ifdef P4FILESYS
+	journal_format();
+#endif
 	free_map_create();
 	if (!dir_create(ROOT_DIR_SECTOR, 16))
 		PANIC("root directory creation failed");
@@ -345,46 +501,653 @@ void filesys_filename(char** fname, char* path)
 	strlcpy(*fname, file, len);
 }
 
-struct buffer_struct* buffer_evict(uint32_t sector)
+/* Makes room for SECTOR in the buffer cache and returns the entry
+ that now holds it, pinned and placed in the segment matching
+ TYPE.  If READ is true the sector is read from disk; otherwise
+ the entry is returned still busy, because the caller is about to
+ overwrite all of it.  Once the cache is full the entry chosen by
+ buffer_victim() is reused.
+
+ Returns a null pointer if the caller must look SECTOR up again:
+ after a dirty victim has been written back, or after waiting for
+ some entry to be unpinned.  BUFFER_LOCK must be held; it is
+ released during disk I/O and while waiting. */
+struct buffer_struct* buffer_evict(uint32_t sector, int type, bool read)
 {
 	struct buffer_struct *bc = NULL;
 
-	if (buffer_size > BUFFER_SIZE)
+	if (buffer_size >= BUFFER_SIZE)
 	{
-		for (struct list_elem *e = list_begin(&list_buffer);
-				e != list_end(&list_buffer); e = list_next(e))
+		bc = buffer_victim();
+		if (bc == NULL)
 		{
-			if (list_entry(e, struct buffer_struct, buffer_listelem)->dirty
-					&& !list_entry(e, struct buffer_struct, buffer_listelem)->access)
-			{
-				bc = list_entry(e, struct buffer_struct, buffer_listelem);
-				block_write(fs_device, bc->sector, &bc->content);
+			cond_wait(&buffer_unpinned, &buffer_lock);
+			return NULL;
+		}
+		if (bc->dirty)
+		{
+			//write back with the old sector still mapped, so that readers
+			//of it wait for the write instead of reading stale data
+			bc->busy = true;
+			lock_release(&buffer_lock);
+			block_write(fs_device, bc->sector, &bc->content);
+			lock_acquire(&buffer_lock);
+			bc->dirty = false;
+			bc->busy = false;
+			cond_broadcast(&bc->io_done, &buffer_lock);
+			return NULL;
+		}
+		hash_delete(&hash_buffer, &bc->buffer_hashelem);
+		list_remove(&bc->buffer_listelem);
+		segment_size[bc->segment] -= 1;
+		if (bc->segment == SEG_A1)
+			buffer_ghost_add(bc->sector);
+	}
+	else
+	{
+		bc = (struct buffer_struct *) malloc(sizeof(struct buffer_struct));
+		if (bc == NULL)
+			PANIC("Unable to allocate more buffer");
+		lock_init(&bc->lock);
+		cond_init(&bc->io_done);
+		buffer_size += 1;
+	}
+
+	bc->sector = sector;
+	bc->dirty = false;
+	bc->meta = false;
+	bc->readahead = false;
+	bc->busy = true;
+	bc->users = 1;
+	if (type == BUF_META)
+		bc->segment = SEG_META;
+	else if (buffer_ghost_remove(sector))
+		bc->segment = SEG_AM;
+	else
+		bc->segment = SEG_A1;
+	list_push_back(&list_segment[bc->segment], &bc->buffer_listelem);
+	segment_size[bc->segment] += 1;
+	hash_insert(&hash_buffer, &bc->buffer_hashelem);
+
+	if (read)
+	{
+		lock_release(&buffer_lock);
+		block_read(fs_device, bc->sector, &bc->content);
+		lock_acquire(&buffer_lock);
+		bc->busy = false;
+		cond_broadcast(&bc->io_done, &buffer_lock);
+	}
+	return bc;
+}
+
+/* Chooses the buffer cache entry to replace: metadata only once
+ SEG_META is over its quota, SEG_A1 while it is over its quota, and
+ otherwise the least recently used entry of SEG_AM.  Pinned and
+ busy entries are skipped, falling back to the other segments.
+ Dirty metadata is never taken: it has not been committed, and
+ writing it home here would bypass the journal.  It stays cached
+ until the next group commit; the credits journal_begin() reserves
+ keep it to half the cache.  Returns a null pointer if every entry
+ is in use.  BUFFER_LOCK must be held. */
+static struct buffer_struct* buffer_victim(void)
+{
+	static const int fallback[SEG_CNT] =
+	{ SEG_A1, SEG_AM, SEG_META };
+	int segment;
+
+	if (segment_size[SEG_META] > META_QUOTA)
+		segment = SEG_META;
+	else if (!list_empty(&list_segment[SEG_A1])
+			&& (segment_size[SEG_A1] > A1_QUOTA
+					|| list_empty(&list_segment[SEG_AM])))
+		segment = SEG_A1;
+	else if (!list_empty(&list_segment[SEG_AM]))
+		segment = SEG_AM;
+	else
+		segment = SEG_META;
+
+	for (int i = -1; i < SEG_CNT; i++)
+	{
+		struct list *l = &list_segment[i < 0 ? segment : fallback[i]];
+		for (struct list_elem *e = list_begin(l); e != list_end(l);
+				e = list_next(e))
+		{
+			struct buffer_struct *bc = list_entry(e, struct buffer_struct,
+					buffer_listelem);
+			if (!bc->busy && bc->users == 0 && !(bc->dirty && bc->meta))
+				return bc;
+		}
+	}
+	return NULL;
+}
+
+/* Returns the buffer cache entry holding SECTOR, or a null
+ pointer if SECTOR is not cached.  BUFFER_LOCK must be held. */
+struct buffer_struct* buffer_lookup(uint32_t sector)
+{
+	struct buffer_struct b;
+	struct hash_elem *e;
+
+	b.sector = sector;
+	e = hash_find(&hash_buffer, &b.buffer_hashelem);
+	return e != NULL ?
+			hash_entry(e, struct buffer_struct, buffer_hashelem) : NULL;
+}
+
+/* Returns the buffer cache entry holding SECTOR, pinned, bringing
+ it in with buffer_evict() if it is not cached yet.  If the sector
+ is already being read by another thread, waits for that read
+ instead of issuing a second one.  A hit refreshes the entry's
+ position in SEG_AM or SEG_META and moves sectors used as metadata
+ into SEG_META.  BUFFER_LOCK must be held. */
+static struct buffer_struct* buffer_fetch(uint32_t sector, int type,
+		bool read)
+{
+	struct buffer_struct *bc;
+
+	for (;;)
+	{
+		bc = buffer_lookup(sector);
+		if (bc == NULL)
+		{
+			bc = buffer_evict(sector, type, read);
+			if (bc == NULL)
+				continue;
+			segment_misses[bc->segment]++;
+			return bc;
+		}
+		if (bc->busy)
+		{
+			cond_wait(&bc->io_done, &buffer_lock);
+			continue;
+		}
+
+		segment_hits[bc->segment]++;
+		if (type == BUF_META && bc->segment != SEG_META)
+		{
+			segment_size[bc->segment] -= 1;
+			bc->segment = SEG_META;
+			segment_size[bc->segment] += 1;
+		}
+		if (bc->segment != SEG_A1)
+		{
+			list_remove(&bc->buffer_listelem);
+			list_push_back(&list_segment[bc->segment], &bc->buffer_listelem);
+		}
+		bc->users++;
+		return bc;
+	}
+}
+
+/* Releases a pin on BC taken by buffer_fetch() or buffer_evict().
+ If BC was returned busy, its contents are now valid. */
+void buffer_unpin(struct buffer_struct *bc)
+{
+	lock_acquire(&buffer_lock);
+	if (bc->busy)
+	{
+		bc->busy = false;
+		cond_broadcast(&bc->io_done, &buffer_lock);
+	}
+	if (--bc->users == 0)
+		cond_broadcast(&buffer_unpinned, &buffer_lock);
+	lock_release(&buffer_lock);
+}
+
+/* Copies SIZE bytes starting at SECTOR_OFS within SECTOR into
+ BUFFER, going through the buffer cache.  TYPE is BUF_DATA or
+ BUF_META. */
+void buffer_read(uint32_t sector, void *buffer, int sector_ofs, int size,
+		int type)
+{
+	lock_acquire(&buffer_lock);
+	struct buffer_struct *bc = buffer_fetch(sector, type, true);
+	if (bc->readahead)
+	{
+		readahead_hits++;
+		bc->readahead = false;
+	}
+	lock_release(&buffer_lock);
+
+	lock_acquire(&bc->lock);
+	memcpy(buffer, (void *) &bc->content + sector_ofs, (size_t) size);
+	lock_release(&bc->lock);
+	buffer_unpin(bc);
+}
+
+/* Copies SIZE bytes from BUFFER into SECTOR starting at
+ SECTOR_OFS, going through the buffer cache.  TYPE is BUF_DATA or
+ BUF_META.  The sector is written back to disk by the write-behind
+ thread, when it is evicted or in filesys_done(). */
+void buffer_write(uint32_t sector, const void *buffer, int sector_ofs,
+		int size, int type)
+{
+	lock_acquire(&buffer_lock);
+	struct buffer_struct *bc = buffer_fetch(sector, type,
+			sector_ofs != 0 || size != BLOCK_SECTOR_SIZE);
+	if (bc->readahead)
+	{
+		readahead_hits++;
+		bc->readahead = false;
+	}
+	lock_release(&buffer_lock);
+
+	lock_acquire(&bc->lock);
+	memcpy((void *) &bc->content + sector_ofs, buffer, (size_t) size);
+	bool uncommitted = bc->dirty && bc->meta;
+	bc->dirty = true;
+	if (type == BUF_META)
+		bc->meta = true;
+	uncommitted = !uncommitted && bc->meta;
+	lock_release(&bc->lock);
+	if (uncommitted)
+	{
+		lock_acquire(&buffer_lock);
+		meta_dirty_cnt++;
+		lock_release(&buffer_lock);
+	}
+	buffer_unpin(bc);
+}
+
+/* Returns the number of cached metadata sectors changed since the
+ last group commit. */
+size_t buffer_meta_dirty(void)
+{
+	return meta_dirty_cnt;
+}
+
+/* Drops SECTOR from the buffer cache without writing it back,
+ once no one is using it.  Called when SECTOR is freed, so that
+ stale contents can never reach the disk or a later user of the
+ sector. */
+void buffer_discard(uint32_t sector)
+{
+	struct buffer_struct *bc;
+
+	lock_acquire(&buffer_lock);
+	while ((bc = buffer_lookup(sector)) != NULL
+			&& (bc->busy || bc->users > 0))
+		cond_wait(bc->busy ? &bc->io_done : &buffer_unpinned, &buffer_lock);
+	if (bc != NULL)
+	{
+		if (bc->dirty && bc->meta)
+			meta_dirty_cnt--;
+		hash_delete(&hash_buffer, &bc->buffer_hashelem);
+		list_remove(&bc->buffer_listelem);
+		segment_size[bc->segment] -= 1;
+		buffer_size -= 1;
+		free(bc);
+	}
+	buffer_ghost_remove(sector);
+	lock_release(&buffer_lock);
+}
+
+/* Remembers SECTOR as recently evicted from SEG_A1, forgetting
+ the oldest such sector if there are already GHOST_SIZE of them.
+ BUFFER_LOCK must be held. */
+static void buffer_ghost_add(uint32_t sector)
+{
+	struct ghost_struct *g;
+
+	if (ghost_size >= GHOST_SIZE)
+	{
+		g = list_entry(list_pop_front(&list_ghost), struct ghost_struct,
+				ghost_listelem);
+		hash_delete(&hash_ghost, &g->ghost_hashelem);
+	}
+	else
+	{
+		g = (struct ghost_struct *) malloc(sizeof(struct ghost_struct));
+		if (g == NULL)
+			return;
+		ghost_size += 1;
+	}
+	g->sector = sector;
+	list_push_back(&list_ghost, &g->ghost_listelem);
+	if (hash_insert(&hash_ghost, &g->ghost_hashelem) != NULL)
+	{
+		list_remove(&g->ghost_listelem);
+		ghost_size -= 1;
+		free(g);
+	}
+}
+
+/* Forgets SECTOR as a ghost.  Returns true if it was one.
+ BUFFER_LOCK must be held. */
+static bool buffer_ghost_remove(uint32_t sector)
+{
+	struct ghost_struct g;
+	struct hash_elem *e;
+
+	g.sector = sector;
+	e = hash_delete(&hash_ghost, &g.ghost_hashelem);
+	if (e == NULL)
+		return false;
+	struct ghost_struct *ghost = hash_entry(e, struct ghost_struct,
+			ghost_hashelem);
+	list_remove(&ghost->ghost_listelem);
+	ghost_size -= 1;
+	free(ghost);
+	return true;
+}
+
+/* Queues SECTOR to be brought into the buffer cache by the
+ read-ahead thread.  The request is dropped if the queue is
+ already as large as the cache itself. */
+void buffer_readahead(uint32_t sector)
+{
+	struct readahead_struct *ra;
+
+	if (readahead_window == 0 || readahead_size >= BUFFER_SIZE
+			|| buffer_stopping)
+		return;
+	ra = (struct readahead_struct *) malloc(sizeof(struct readahead_struct));
+	if (ra == NULL)
+		return;
+	ra->sector = sector;
+
+	lock_acquire(&readahead_lock);
+	list_push_back(&list_readahead, &ra->readahead_listelem);
+	readahead_size += 1;
+	lock_release(&readahead_lock);
+	sema_up(&readahead_sema);
+}
+
+/* Read-ahead thread: loads queued sectors into the buffer cache
+ so that sequential readers find them there, until filesys_done()
+ stops it.  Requests still queued then are dropped. */
+static void buffer_readahead_worker(void *aux UNUSED)
+{
+	struct buffer_struct *run[READAHEAD_RUN];
+	uint8_t *content = malloc(READAHEAD_RUN * BLOCK_SECTOR_SIZE);
+
+	if (content == NULL)
+		PANIC("Unable to allocate the read-ahead buffer");
+	for (;;)
+	{
+		struct readahead_struct *ra;
+		uint32_t first, start;
+		size_t queued = 1, cnt = 0;
+
+		sema_down(&readahead_sema);
+		if (buffer_stopping)
+			break;
+		lock_acquire(&readahead_lock);
+		ra = list_entry(list_pop_front(&list_readahead),
+				struct readahead_struct, readahead_listelem);
+		readahead_size -= 1;
+		first = ra->sector;
+		free(ra);
+		//requests for the sectors that follow join the same transfer
+		while (queued < READAHEAD_RUN && !list_empty(&list_readahead))
+		{
+			ra = list_entry(list_front(&list_readahead),
+					struct readahead_struct, readahead_listelem);
+			if (ra->sector != first + queued || !sema_try_down(&readahead_sema))
 				break;
-			}
-			else if (list_entry(e, struct buffer_struct, buffer_listelem)->access)
+			list_pop_front(&list_readahead);
+			readahead_size -= 1;
+			free(ra);
+			queued++;
+		}
+		lock_release(&readahead_lock);
+
+		//claim the sectors not cached yet, up to the first cached one
+		//after them, without reading them
+		start = first;
+		lock_acquire(&buffer_lock);
+		for (size_t i = 0; i < queued; i++)
+		{
+			struct buffer_struct *bc = NULL;
+			while (bc == NULL && buffer_lookup(first + i) == NULL)
+				bc = buffer_evict(first + i, BUF_DATA, false);
+			if (bc == NULL)
 			{
-				list_entry(e, struct buffer_struct, buffer_listelem)->access =
-				false;
+				if (cnt > 0)
+					break;
+				start = first + i + 1;
+				continue;
 			}
+			bc->readahead = true;
+			readahead_cnt++;
+			run[cnt++] = bc;
 		}
-		if (bc != NULL)
+		lock_release(&buffer_lock);
+
+		block_read_multi(fs_device, start, cnt, content);
+		for (size_t i = 0; i < cnt; i++)
 		{
-			bc->sector = sector;
-			block_read(fs_device, bc->sector, &bc->content);
-			return bc;
+			lock_acquire(&run[i]->lock);
+			memcpy(&run[i]->content, content + i * BLOCK_SECTOR_SIZE,
+					BLOCK_SECTOR_SIZE);
+			lock_release(&run[i]->lock);
+			buffer_unpin(run[i]);
 		}
-		return NULL;
 	}
-	bc = (struct buffer_struct *) malloc(sizeof(struct buffer_struct));
-	if (bc != NULL)
+
+	lock_acquire(&readahead_lock);
+	while (!list_empty(&list_readahead))
+		free(list_entry(list_pop_front(&list_readahead),
+				struct readahead_struct, readahead_listelem));
+	readahead_size = 0;
+	lock_release(&readahead_lock);
+	free(content);
+	sema_up(&readahead_exit);
+}
+
+/* Writes every dirty buffer back to disk in ascending sector
+ order and clears its dirty bit.  This is also the journal's group
+ commit: with metadata operations held off, each dirty entry is
+ pinned and copied out under its own lock, data and metadata to
+ separate arrays.  Then data goes to disk first, so committed
+ metadata never points at unwritten data, and the metadata is
+ committed to the journal as one sequential write before it is
+ written home.  Runs of consecutive sectors are written with one
+ block_write_multi() each.  No lock is held during the writes. */
+void buffer_flush(void)
+{
+	struct buffer_struct **dirty;
+	block_sector_t *sectors[2];
+	uint8_t *copies[2];
+	size_t cnt[2] =
+	{ 0, 0 };
+	struct hash_iterator i;
+	size_t dirty_cnt = 0;
+
+	lock_acquire(&buffer_flush_lock);
+	journal_quiesce();
+	//free map changes are written into the cache first, so they go
+	//out in this same pass
+	free_map_flush();
+	lock_acquire(&buffer_lock);
+	dirty = malloc(buffer_size * sizeof *dirty);
+	for (int k = 0; k < 2; k++)
 	{
-		list_push_back(&list_buffer, &bc->buffer_listelem);
-		bc->sector = sector;
-		block_read(fs_device, bc->sector, &bc->content);
-		buffer_size += 1;
-		return bc;
+		sectors[k] = malloc(buffer_size * sizeof *sectors[k]);
+		copies[k] = malloc(buffer_size * BLOCK_SECTOR_SIZE);
 	}
-	return NULL;
+	if (dirty == NULL || sectors[0] == NULL || sectors[1] == NULL
+			|| copies[0] == NULL || copies[1] == NULL)
+	{
+		lock_release(&buffer_lock);
+		journal_resume();
+		lock_release(&buffer_flush_lock);
+		free(dirty);
+		for (int k = 0; k < 2; k++)
+		{
+			free(sectors[k]);
+			free(copies[k]);
+		}
+		return;
+	}
+	hash_first(&i, &hash_buffer);
+	while (hash_next(&i))
+	{
+		struct buffer_struct *bc = hash_entry(hash_cur(&i),
+				struct buffer_struct, buffer_hashelem);
+		if (bc->dirty && !bc->busy)
+		{
+			bc->users++;
+			dirty[dirty_cnt++] = bc;
+		}
+	}
+	lock_release(&buffer_lock);
+
+	qsort(dirty, dirty_cnt, sizeof *dirty, buffer_sector_compare);
+	for (size_t j = 0; j < dirty_cnt; j++)
+	{
+		struct buffer_struct *bc = dirty[j];
+		bool was_dirty;
+
+		lock_acquire(&bc->lock);
+		was_dirty = bc->dirty;
+		if (was_dirty)
+		{
+			int k = bc->meta ? BUF_META : BUF_DATA;
+			memcpy(copies[k] + cnt[k] * BLOCK_SECTOR_SIZE, &bc->content,
+					BLOCK_SECTOR_SIZE);
+			sectors[k][cnt[k]++] = bc->sector;
+		}
+		bc->dirty = false;
+		lock_release(&bc->lock);
+		if (!was_dirty)
+		{
+			buffer_unpin(bc);
+			dirty[j] = NULL;
+		}
+	}
+	lock_acquire(&buffer_lock);
+	meta_dirty_cnt -= cnt[BUF_META];
+	lock_release(&buffer_lock);
+	journal_resume();
+
+	buffer_write_runs(sectors[BUF_DATA], copies[BUF_DATA], cnt[BUF_DATA]);
+	journal_commit(sectors[BUF_META], copies[BUF_META], cnt[BUF_META]);
+	free_map_reclaim();
+	buffer_write_runs(sectors[BUF_META], copies[BUF_META], cnt[BUF_META]);
+	if (cnt[BUF_META] > 0)
+		journal_checkpoint();
+
+	for (size_t j = 0; j < dirty_cnt; j++)
+		if (dirty[j] != NULL)
+			buffer_unpin(dirty[j]);
+	lock_release(&buffer_flush_lock);
+	free(dirty);
+	for (int k = 0; k < 2; k++)
+	{
+		free(sectors[k]);
+		free(copies[k]);
+	}
+}
+
+/* Writes the CNT sectors in COPIES to SECTORS, which are in
+ ascending order, one request per run of consecutive sectors.
+ All runs are submitted before waiting for any of them, so the
+ device queue can order and merge them. */
+static void buffer_write_runs(const block_sector_t *sectors,
+		const uint8_t *copies, size_t cnt)
+{
+	struct block_request *requests;
+	size_t runs = 0, start = 0;
+
+	if (cnt == 0)
+		return;
+	for (size_t j = 1; j <= cnt; j++)
+		if (j == cnt || sectors[j] != sectors[j - 1] + 1)
+			runs++;
+	requests = malloc(runs * sizeof *requests);
+	if (requests == NULL)
+		PANIC("buffer_write_runs: out of memory");
+
+	runs = 0;
+	for (size_t j = 1; j <= cnt; j++)
+		if (j == cnt || sectors[j] != sectors[j - 1] + 1)
+		{
+			block_write_async(fs_device, sectors[start], j - start,
+					copies + start * BLOCK_SECTOR_SIZE, &requests[runs++]);
+			start = j;
+		}
+	for (size_t j = 0; j < runs; j++)
+		block_wait(&requests[j]);
+	free(requests);
+}
+
+/* Write-behind thread: flushes dirty buffers every
+ FLUSH_INTERVAL ticks, so that eviction rarely has to write, until
+ filesys_done() stops it.  It sleeps in FLUSH_POLL slices so that
+ shutdown does not wait out a whole interval. */
+static void buffer_flush_worker(void *aux UNUSED)
+{
+	while (!buffer_stopping)
+	{
+		for (int64_t t = 0; t < FLUSH_INTERVAL && !buffer_stopping;
+				t += FLUSH_POLL)
+			timer_sleep(FLUSH_POLL);
+		if (!buffer_stopping)
+			buffer_flush();
+	}
+	sema_up(&flush_exit);
+}
+
+/* Orders buffer cache entry pointers by sector. */
+static int buffer_sector_compare(const void *a_, const void *b_)
+{
+	const struct buffer_struct *a = *(struct buffer_struct * const *) a_;
+	const struct buffer_struct *b = *(struct buffer_struct * const *) b_;
+
+	return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Prints buffer cache statistics. */
+void buffer_print_stats(void)
+{
+	static const char *segment_names[SEG_CNT] =
+	{ "a1", "am", "meta" };
+
+	for (int i = 0; i < SEG_CNT; i++)
+	{
+		unsigned long long total = segment_hits[i] + segment_misses[i];
+		printf("Buffer cache (%s): %llu hits, %llu misses, %llu%% hit ratio\n",
+				segment_names[i], segment_hits[i], segment_misses[i],
+				total ? segment_hits[i] * 100 / total : 0);
+	}
+	printf("Buffer cache: %llu sectors read ahead, %llu read-ahead hits\n",
+			readahead_cnt, readahead_hits);
+}
+
+static unsigned buffer_hash(const struct hash_elem *b_, void *aux UNUSED)
+{
+	const struct buffer_struct *b = hash_entry(b_, struct buffer_struct,
+			buffer_hashelem);
+	return hash_int((int) b->sector);
+}
+
+static bool buffer_less_helper(const struct hash_elem *a_,
+		const struct hash_elem *b_, void *aux UNUSED)
+{
+	const struct buffer_struct *a = hash_entry(a_, struct buffer_struct,
+			buffer_hashelem);
+	const struct buffer_struct *b = hash_entry(b_, struct buffer_struct,
+			buffer_hashelem);
+
+	return a->sector < b->sector;
+}
+
+static unsigned ghost_hash(const struct hash_elem *g_, void *aux UNUSED)
+{
+	const struct ghost_struct *g = hash_entry(g_, struct ghost_struct,
+			ghost_hashelem);
+	return hash_int((int) g->sector);
+}
+
+static bool ghost_less_helper(const struct hash_elem *a_,
+		const struct hash_elem *b_, void *aux UNUSED)
+{
+	const struct ghost_struct *a = hash_entry(a_, struct ghost_struct,
+			ghost_hashelem);
+	const struct ghost_struct *b = hash_entry(b_, struct ghost_struct,
+			ghost_hashelem);
 
+	return a->sector < b->sector;
 }
 #endif
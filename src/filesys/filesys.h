@@ -6,6 +6,7 @@
 #ifdef P4FILESYS
 #include "filesys/directory.h"
 #include <list.h>
+#include <hash.h>
 #include "threads/synch.h"
 #endif
 
@@ -15,21 +16,59 @@
 
 #ifdef P4FILESYS
 #define BUFFER_SIZE 64
+#define READAHEAD_WINDOW 4      /* Default sectors fetched ahead. */
+#define READAHEAD_RUN 8         /* Most sectors read ahead at once. */
+#define FLUSH_INTERVAL 300      /* Timer ticks between write-behinds. */
+#define FLUSH_POLL 10           /* Timer ticks between checks for shutdown. */
+
+/* -ra: Sectors to read ahead of a sequential reader. */
+extern uint32_t readahead_window;
+
+//type of a cached sector, used to pick its replacement segment
+#define BUF_DATA 0              /* File and directory data. */
+#define BUF_META 1              /* Inodes and index blocks. */
+
+//replacement segments of the buffer cache (2Q)
+#define SEG_A1 0                /* Data used once: FIFO. */
+#define SEG_AM 1                /* Data used again: LRU. */
+#define SEG_META 2              /* Protected metadata: LRU. */
+#define SEG_CNT 3
 
 struct lock buffer_lock;
 uint32_t buffer_size;
-struct list list_buffer;
 
+/* A buffer cache entry.  BUFFER_LOCK protects the cache index and
+ segments and each entry's sector, segment, busy and users fields.
+ An entry's LOCK protects its content and dirty bit while it is
+ pinned; an unpinned entry is only touched with BUSY set. */
 struct buffer_struct
 {
 	bool dirty;
-	bool access;
+	bool meta; //written as BUF_META: committed through the journal
+	bool readahead; //loaded by read-ahead and not used yet
+	int segment; //replacement segment holding this entry
+	bool busy; //content is being read or replaced; wait on io_done
+	int users; //pins; a pinned entry is never evicted
+	struct lock lock; //serializes access to content
+	struct condition io_done; //signalled when busy clears
 	uint8_t content[BLOCK_SECTOR_SIZE];
 	uint32_t sector;
-	struct list_elem buffer_listelem;
+	struct list_elem buffer_listelem; //position in its segment
+	struct hash_elem buffer_hashelem; //sector lookup
 };
 
-struct buffer_struct* buffer_evict(uint32_t sector);
+struct buffer_struct* buffer_evict(uint32_t sector, int type, bool read);
+void buffer_unpin(struct buffer_struct *bc);
+struct buffer_struct* buffer_lookup(uint32_t sector);
+void buffer_read(uint32_t sector, void *buffer, int sector_ofs, int size,
+		int type);
+void buffer_write(uint32_t sector, const void *buffer, int sector_ofs,
+		int size, int type);
+void buffer_discard(uint32_t sector);
+void buffer_readahead(uint32_t sector);
+void buffer_flush(void);
+size_t buffer_meta_dirty(void);
+void buffer_print_stats(void);
 #endif
 
 /* Block device that contains the file system. */
@@ -1,12 +1,58 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
+#include <stdio.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+#ifdef P4FILESYS
+/* Changes to the free map are written back by the write-behind
+   thread, one free map file sector at a time. */
+static struct bitmap *free_map_dirty; /* Dirty sectors of the file. */
+static struct lock free_map_lock;     /* Protects all the bitmaps. */
+static unsigned long long free_map_write_cnt;  /* Sectors written. */
+static unsigned long long free_map_flush_cnt;  /* Flushes writing any. */
+
+/* The disk is split into allocation groups of GROUP_SECTORS
+   sectors.  Each keeps a count of its free sectors, so full groups
+   are skipped without scanning, and a next-fit cursor.  Callers
+   pass a hint sector, normally the inode the sectors belong to,
+   and the search starts in the hint's group. */
+#define GROUP_SECTORS 512
+
+struct free_map_group
+  {
+    size_t free_cnt;                  /* Free sectors in the group. */
+    block_sector_t cursor;            /* Where the next scan starts. */
+  };
+
+static struct free_map_group *groups;
+static size_t group_cnt;
+
+/* A sector freed by a journal operation must not be reused before
+   the commit that frees it, or a crash would leave it in the file
+   that still owns it on disk with another file's data.  Such
+   sectors stay set in free_map and are only revoked: free_map_flush()
+   writes them out as free, as part of the commit, and moves them to
+   free_map_committing, and free_map_reclaim() clears them in
+   free_map once the commit is in the journal. */
+static struct bitmap *free_map_revoked;    /* Freed, not committed. */
+static struct bitmap *free_map_committing; /* Freed by this commit. */
+
+static void free_map_set_bits (const struct bitmap *, bool);
+
+static void free_map_mark_dirty (block_sector_t, size_t);
+static void free_map_count_groups (void);
+static void free_map_account (block_sector_t, size_t, bool);
+static size_t free_map_find (block_sector_t, size_t);
+#endif
 
 /* Initializes the free map. */
 void
@@ -17,6 +63,22 @@ free_map_init (void)
     PANIC ("bitmap creation failed--file system device is too large");
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+#ifdef P4FILESYS
+  bitmap_set_multiple (free_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+  free_map_dirty = bitmap_create (DIV_ROUND_UP (bitmap_file_size (free_map),
+                                                BLOCK_SECTOR_SIZE));
+  free_map_revoked = bitmap_create (bitmap_size (free_map));
+  free_map_committing = bitmap_create (bitmap_size (free_map));
+  if (free_map_dirty == NULL || free_map_revoked == NULL
+      || free_map_committing == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  lock_init (&free_map_lock);
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), GROUP_SECTORS);
+  groups = malloc (group_cnt * sizeof *groups);
+  if (groups == NULL)
+    PANIC ("can't allocate free map groups");
+  free_map_count_groups ();
+#endif
 }
 
 /* Allocates CNT consecutive sectors from the free map and stores
@@ -27,6 +89,9 @@ free_map_init (void)
 bool
 free_map_allocate (size_t cnt, block_sector_t *sectorp)
 {
+#ifdef P4FILESYS
+  return free_map_allocate_near (0, cnt, sectorp);
+#else
   block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
   if (sector != BITMAP_ERROR
       && free_map_file != NULL
@@ -38,15 +103,88 @@ free_map_allocate (size_t cnt, block_sector_t *sectorp)
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
   return sector != BITMAP_ERROR;
+#endif
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+#ifdef P4FILESYS
+/* Allocates CNT consecutive sectors as near HINT as possible and
+   stores the first into *SECTORP.  Returns true if successful,
+   false if not enough consecutive sectors were available. */
+bool
+free_map_allocate_near (block_sector_t hint, size_t cnt,
+                        block_sector_t *sectorp)
+{
+  size_t sector;
+  lock_acquire (&free_map_lock);
+  sector = free_map_find (hint, cnt);
+  if (sector != BITMAP_ERROR)
+    {
+      bitmap_set_multiple (free_map, sector, cnt, true);
+      free_map_mark_dirty (sector, cnt);
+      free_map_account (sector, cnt, true);
+      groups[sector / GROUP_SECTORS].cursor = sector + cnt;
+      *sectorp = sector;
+    }
+  lock_release (&free_map_lock);
+  return sector != BITMAP_ERROR;
+}
+
+/* Allocates up to CNT free sectors starting exactly at SECTOR,
+   stopping at the first one in use.  Returns the number of
+   sectors allocated, which may be 0. */
+size_t
+free_map_extend (block_sector_t sector, size_t cnt)
+{
+  size_t n = 0;
+  lock_acquire (&free_map_lock);
+  while (n < cnt && sector + n < bitmap_size (free_map)
+         && !bitmap_test (free_map, sector + n))
+    n++;
+  if (n > 0)
+    {
+      bitmap_set_multiple (free_map, sector, n, true);
+      free_map_mark_dirty (sector, n);
+      free_map_account (sector, n, true);
+    }
+  lock_release (&free_map_lock);
+  return n;
+}
+
+/* Allocates a run of consecutive sectors near HINT, as long as
+   possible but no longer than CNT, and stores the first into
+   *SECTORP.  Shorter runs are tried by halving CNT.  Returns the
+   number of sectors allocated, or 0 if the disk is full. */
+size_t
+free_map_allocate_run (block_sector_t hint, size_t cnt,
+                       block_sector_t *sectorp)
+{
+  for (; cnt > 0; cnt /= 2)
+    if (free_map_allocate_near (hint, cnt, sectorp))
+      return cnt;
+  return 0;
+}
+#endif
+
+/* Makes CNT sectors starting at SECTOR available for use.  Under
+   P4FILESYS they become available once the journal commit that
+   frees them is done. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
   ASSERT (bitmap_all (free_map, sector, cnt));
+#ifdef P4FILESYS
+  for (size_t i = 0; i < cnt; i++)
+    buffer_discard (sector + i);
+  lock_acquire (&free_map_lock);
+  ASSERT (bitmap_none (free_map_revoked, sector, cnt));
+  ASSERT (bitmap_none (free_map_committing, sector, cnt));
+  bitmap_set_multiple (free_map_revoked, sector, cnt, true);
+  free_map_mark_dirty (sector, cnt);
+  lock_release (&free_map_lock);
+#else
   bitmap_set_multiple (free_map, sector, cnt, false);
   bitmap_write (free_map, free_map_file);
+#endif
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,13 +196,24 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+#ifdef P4FILESYS
+  free_map_count_groups ();
+#endif
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void)
 {
+#ifdef P4FILESYS
+  free_map_flush ();
+  lock_acquire (&free_map_lock);
   file_close (free_map_file);
+  free_map_file = NULL;
+  lock_release (&free_map_lock);
+#else
+  file_close (free_map_file);
+#endif
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -87,3 +236,176 @@ free_map_create (void)
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
 }
+
+#ifdef P4FILESYS
+/* Marks the free map file sectors holding the bits for CNT
+   sectors starting at SECTOR as dirty.  The caller must hold
+   free_map_lock. */
+static void
+free_map_mark_dirty (block_sector_t sector, size_t cnt)
+{
+  size_t first = sector / 8 / BLOCK_SECTOR_SIZE;
+  size_t last = (sector + cnt - 1) / 8 / BLOCK_SECTOR_SIZE;
+  if (cnt == 0)
+    return;
+  bitmap_set_multiple (free_map_dirty, first, last - first + 1, true);
+}
+
+/* Recomputes the free count of every allocation group from the
+   free map and resets the cursors. */
+static void
+free_map_count_groups (void)
+{
+  size_t g;
+
+  for (g = 0; g < group_cnt; g++)
+    {
+      block_sector_t start = g * GROUP_SECTORS;
+      size_t cnt = bitmap_size (free_map) - start;
+      if (cnt > GROUP_SECTORS)
+        cnt = GROUP_SECTORS;
+      groups[g].free_cnt = bitmap_count (free_map, start, cnt, false);
+      groups[g].cursor = start;
+    }
+}
+
+/* Updates the free counts of the groups holding the CNT sectors
+   starting at SECTOR, which have just been allocated if USED is
+   true or released otherwise.  The caller must hold
+   free_map_lock. */
+static void
+free_map_account (block_sector_t sector, size_t cnt, bool used)
+{
+  while (cnt > 0)
+    {
+      struct free_map_group *g = &groups[sector / GROUP_SECTORS];
+      size_t n = GROUP_SECTORS - sector % GROUP_SECTORS;
+      if (n > cnt)
+        n = cnt;
+      if (used)
+        g->free_cnt -= n;
+      else
+        g->free_cnt += n;
+      sector += n;
+      cnt -= n;
+    }
+}
+
+/* Returns the first sector of a free run of CNT sectors within
+   group G at or after FROM, or BITMAP_ERROR if there is none. */
+static size_t
+free_map_group_scan (size_t g, block_sector_t from, size_t cnt)
+{
+  size_t end = (g + 1) * GROUP_SECTORS;
+  size_t i;
+
+  if (end > bitmap_size (free_map))
+    end = bitmap_size (free_map);
+  for (i = from; i + cnt <= end; i++)
+    if (!bitmap_contains (free_map, i, cnt, true))
+      return i;
+  return BITMAP_ERROR;
+}
+
+/* Returns the first sector of a free run of CNT sectors near HINT,
+   or BITMAP_ERROR if there is none.  Groups are tried in order
+   from the one holding HINT, skipping those without CNT free
+   sectors, each from its cursor first and then from its start.
+   A run that fits in no single group is searched for across the
+   whole disk.  The caller must hold free_map_lock. */
+static size_t
+free_map_find (block_sector_t hint, size_t cnt)
+{
+  size_t first = hint / GROUP_SECTORS % group_cnt;
+  size_t k;
+
+  for (k = 0; k < group_cnt; k++)
+    {
+      size_t g = (first + k) % group_cnt;
+      size_t sector;
+
+      if (groups[g].free_cnt < cnt)
+        continue;
+      sector = free_map_group_scan (g, groups[g].cursor, cnt);
+      if (sector == BITMAP_ERROR)
+        sector = free_map_group_scan (g, g * GROUP_SECTORS, cnt);
+      if (sector != BITMAP_ERROR)
+        return sector;
+    }
+  return bitmap_scan (free_map, 0, cnt, false);
+}
+
+/* Sets the bits of free_map that are set in BITS to VALUE.  The
+   caller must hold free_map_lock. */
+static void
+free_map_set_bits (const struct bitmap *bits, bool value)
+{
+  size_t i = 0;
+
+  while ((i = bitmap_scan (bits, i, 1, true)) != BITMAP_ERROR)
+    bitmap_set (free_map, i++, value);
+}
+
+/* Writes the dirty sectors of the free map to the free map file.
+   Called by the write-behind thread before it flushes the buffer
+   cache, where these writes land, with journal operations held
+   off.  Revoked sectors are written as free, and are freed by the
+   commit this flush is part of. */
+void
+free_map_flush (void)
+{
+  size_t i, cnt = 0;
+
+  lock_acquire (&free_map_lock);
+  i = 0;
+  while ((i = bitmap_scan (free_map_revoked, i, 1, true)) != BITMAP_ERROR)
+    {
+      bitmap_reset (free_map_revoked, i);
+      bitmap_mark (free_map_committing, i++);
+    }
+  free_map_set_bits (free_map_committing, false);
+  if (free_map_file != NULL)
+    for (i = 0; i < bitmap_size (free_map_dirty); i++)
+      if (bitmap_test (free_map_dirty, i))
+        {
+          bitmap_reset (free_map_dirty, i);
+          if (!bitmap_write_range (free_map, free_map_file,
+                                   i * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE))
+            PANIC ("can't write free map");
+          cnt++;
+        }
+  free_map_set_bits (free_map_committing, true);
+  free_map_write_cnt += cnt;
+  if (cnt > 0)
+    free_map_flush_cnt++;
+  lock_release (&free_map_lock);
+}
+
+/* Makes the sectors freed by the last free_map_flush() available
+   for allocation.  Called once the commit it was part of is in the
+   journal. */
+void
+free_map_reclaim (void)
+{
+  size_t i = 0;
+
+  lock_acquire (&free_map_lock);
+  while ((i = bitmap_scan (free_map_committing, i, 1, true))
+         != BITMAP_ERROR)
+    {
+      bitmap_reset (free_map, i);
+      bitmap_reset (free_map_committing, i);
+      free_map_account (i, 1, false);
+      i++;
+    }
+  lock_release (&free_map_lock);
+}
+
+/* Prints free map write statistics. */
+void
+free_map_print_stats (void)
+{
+  printf ("free map: %llu sector writes in %llu flushes\n",
+          free_map_write_cnt, free_map_flush_cnt);
+}
+#endif
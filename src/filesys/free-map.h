@@ -13,5 +13,13 @@ void free_map_close (void);
 
 bool free_map_allocate (size_t, block_sector_t *);
 void free_map_release (block_sector_t, size_t);
+#ifdef P4FILESYS
+size_t free_map_extend (block_sector_t, size_t);
+bool free_map_allocate_near (block_sector_t, size_t, block_sector_t *);
+size_t free_map_allocate_run (block_sector_t, size_t, block_sector_t *);
+void free_map_flush (void);
+void free_map_reclaim (void);
+void free_map_print_stats (void);
+#endif
 
 #endif /* filesys/free-map.h */
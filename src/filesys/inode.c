@@ -5,6 +5,7 @@
 #include <string.h>
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #ifdef P4FILESYS
 #include "threads/malloc.h"
 #endif
@@ -17,6 +18,48 @@ struct iblock_struct
 {
 	uint32_t block[128];
 };
+
+/* -extents: Layout given to new inodes. */
+int inode_format = FMT_INDEXED;
+
+static bool indexed_expand(struct inode *inode, size_t new_data_sectors,
+		const block_sector_t *given);
+static bool extent_expand(struct inode *inode, off_t length);
+static size_t indexed_sectors(const struct inode *inode);
+static void indexed_shrink(struct inode *inode, size_t old_sectors);
+static bool extent_to_indexed(struct inode *inode);
+static bool inode_fill(struct inode *inode, off_t pos, size_t cnt,
+		off_t write_end, off_t *endp);
+static void inode_write_disk(struct inode *inode);
+static void inline_to_blocks(struct inode *inode);
+static void layout_upgrade(struct inode *inode, bool *exclusive);
+#endif
+static off_t write_at(struct inode *inode, const void *buffer_, off_t size,
+		off_t offset, bool *exclusive);
+#ifdef P4FILESYS
+
+/* Directory contents and the free map are metadata, committed
+ through the journal; everything else is file data. */
+static inline int inode_buf_type(const struct inode *inode)
+{
+	return inode->inode_data[DIR] || inode->sector == FREE_MAP_SECTOR ?
+			BUF_META : BUF_DATA;
+}
+static void data_sector_next(block_sector_t *sectorp,
+		const block_sector_t **given);
+
+/* Returns how many bytes of INODE one journal transaction of
+ inode_write_at() covers.  Filling holes in that many bytes of file
+ data changes at most five L3 index blocks, and with the L1 or L2
+ block and the inode stays within JOURNAL_CREDITS.  Directory data
+ is metadata itself, so for a directory it is a few sectors. */
+static inline off_t write_chunk(const struct inode *inode)
+{
+	off_t sectors = JOURNAL_CREDITS - 4;
+	if (inode_buf_type(inode) == BUF_DATA)
+		sectors *= 128;
+	return sectors * BLOCK_SECTOR_SIZE;
+}
 #endif
 
 /* Returns the number of sectors to allocate for an inode SIZE
@@ -26,11 +69,33 @@ static inline size_t bytes_to_sectors(off_t size)
 	return DIV_ROUND_UP(size, BLOCK_SECTOR_SIZE);
 }
 
+#ifdef P4FILESYS
+/* Returns entry IDX of the index block in SECTOR, going through
+ INODE's copy of the last index block it used.  A zero entry is
+ re-read, since the hole may have been filled after the copy. */
+static block_sector_t index_lookup(struct inode *inode, block_sector_t sector,
+		size_t idx)
+{
+	block_sector_t result;
+
+	lock_acquire(&inode->ib_lock);
+	if (inode->ib_sector != sector || inode->ib_block[idx] == 0)
+	{
+		buffer_read(sector, inode->ib_block, 0, BLOCK_SECTOR_SIZE, BUF_META);
+		inode->ib_sector = sector;
+	}
+	result = inode->ib_block[idx];
+	lock_release(&inode->ib_lock);
+	return result;
+}
+#endif
+
 /* Returns the block device sector that contains byte offset POS
  within INODE.
  Returns -1 if INODE does not contain data for a byte at offset
- POS. */
-uint32_t byte_to_sector(const struct inode *inode, off_t pos)
+ POS or keeps its data inline, or 0 if POS lies in a hole that has
+ not been written yet. */
+uint32_t byte_to_sector(struct inode *inode, off_t pos)
 {
 	if (!inode)
 		PANIC("Error: byte->sector function: inode passed is null!");
@@ -47,26 +112,39 @@ uint32_t byte_to_sector(const struct inode *inode, off_t pos)
 #ifdef P4FILESYS
 			ASSERT(inode!=NULL);
 			ASSERT(pos<MAX_FILESIZE);
-			uint32_t indirect[128];
+			if (inode->inode_data[FMT] == FMT_INLINE)
+				return -1;
+			if (inode->inode_data[FMT] == FMT_EXTENT)
+			{
+				uint32_t n = pos / BLOCK_SECTOR_SIZE;
+				for (uint32_t i = 0; i < inode->inode_data[I0]; i++)
+				{
+					if (n < inode->block[2 * i + 1])
+						return inode->block[2 * i] ? inode->block[2 * i] + n : 0;
+					n -= inode->block[2 * i + 1];
+				}
+				return -1;
+			}
 			off_t i0_limit = BLOCK_SECTOR_SIZE * I0_BLOCKS;
 			off_t i1_limit = BLOCK_SECTOR_SIZE * (I0_BLOCKS + 128);
 			if (pos >= i1_limit)
 			{
-				block_read(fs_device, inode->block[114], &indirect);
+				//index blocks come from the buffer cache, so a mapping
+				//normally costs no disk read at all
+				block_sector_t l2_sector;
 				pos = pos - BLOCK_SECTOR_SIZE * (I0_BLOCKS + 128);
-				block_read(fs_device, indirect[pos / (BLOCK_SECTOR_SIZE * 128)],
-						&indirect);
-				return indirect[(pos % (BLOCK_SECTOR_SIZE * 128))
-						/ BLOCK_SECTOR_SIZE];
+				buffer_read(inode->block[114], &l2_sector,
+						pos / (BLOCK_SECTOR_SIZE * 128) * sizeof(uint32_t),
+						sizeof(uint32_t), BUF_META);
+				return index_lookup(inode, l2_sector,
+						(pos % (BLOCK_SECTOR_SIZE * 128)) / BLOCK_SECTOR_SIZE);
 			}
 			if (pos >= i0_limit && pos < i1_limit)
 			{
 				pos = pos - BLOCK_SECTOR_SIZE * I0_BLOCKS;
-				block_read(fs_device,
-						inode->block[pos / (BLOCK_SECTOR_SIZE * 128)
-								+ I0_BLOCKS], &indirect);
-				return indirect[(pos % (BLOCK_SECTOR_SIZE * 128))
-						/ BLOCK_SECTOR_SIZE];
+				return index_lookup(inode,
+						inode->block[pos / (BLOCK_SECTOR_SIZE * 128) + I0_BLOCKS],
+						(pos % (BLOCK_SECTOR_SIZE * 128)) / BLOCK_SECTOR_SIZE);
 			}
 			if (pos >= 0 && pos < i0_limit)
 				return inode->block[pos / BLOCK_SECTOR_SIZE];
@@ -77,14 +155,44 @@ uint32_t byte_to_sector(const struct inode *inode, off_t pos)
 	return -1;
 }
 
+#ifndef P4FILESYS
 /* List of open inodes, so that opening a single inode twice
  returns the same `struct inode'. */
 static struct list open_inodes;
+#else
+/* Open inodes hashed by sector, so that opening a single inode
+ twice returns the same `struct inode'.  Up to CLOSED_MAX inodes
+ whose last opener has closed them stay in it too, with an
+ open_cnt of 0, so reopening them copies nothing; they are kept in
+ closed_inodes, least recently closed first.  open_inodes_lock is
+ never held across disk I/O: an inode being read in is already in
+ the table, marked loading, and later openers wait on
+ inode_loaded for it. */
+#define CLOSED_MAX 32
+
+static struct hash open_inodes;
+static struct list closed_inodes;
+static size_t closed_cnt;
+static struct lock open_inodes_lock;
+static struct condition inode_loaded;
+
+static unsigned inode_hash(const struct hash_elem *e, void *aux);
+static bool inode_less(const struct hash_elem *a, const struct hash_elem *b,
+		void *aux);
+#endif
 
 /* Initializes the inode module. */
 void inode_init(void)
 {
+#ifndef P4FILESYS
 	list_init(&open_inodes);
+#else
+	hash_init(&open_inodes, inode_hash, inode_less, NULL);
+	list_init(&closed_inodes);
+	closed_cnt = 0;
+	lock_init(&open_inodes_lock);
+	cond_init(&inode_loaded);
+#endif
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -135,6 +243,10 @@ bool inode_create(block_sector_t sector, off_t length, bool is_file)
 	{ };
 	bool success = true;
 
+	inode.sector = sector;
+	lock_init(&inode.ib_lock);
+	rw_init(&inode.layout_lock);
+
 	ASSERT(length >= 0);
 
 	/* If this assertion fails, the inode structure is not exactly
@@ -146,12 +258,26 @@ bool inode_create(block_sector_t sector, off_t length, bool is_file)
 	{
 		// the file size should be less than 2^23, i.e. 8MB
 		ASSERT(length <= (1 << 23));
+		//small files keep their bytes in the inode sector itself
+		if (length <= (off_t) INLINE_MAX && sector != FREE_MAP_SECTOR)
+			inode.inode_data[FMT] = FMT_INLINE;
+		else
+			inode.inode_data[FMT] = inode_format;
 
 		size_t new_data_sectors = (length / BLOCK_SECTOR_SIZE + 1)
 				- DIV_ROUND_UP(inode.inode_data[LEN], BLOCK_SECTOR_SIZE);
-		inode_expand(&inode, length, new_data_sectors);
+		if (!inode_expand(&inode, length, new_data_sectors))
+		{
+			free(disk_inode);
+			return false;
+		}
 		inode.inode_data[LEN] = length;
 
+		//the free map cannot allocate its own blocks while it is
+		//being written, so it gets them all now
+		if (sector == FREE_MAP_SECTOR)
+			inode_fill(&inode, 0, bytes_to_sectors(length), 0, NULL);
+
 		//copy all data from inode to inode_disk
 		for (int i = 0; i < 10; i++)
 			disk_inode->inode_data[i] = inode.inode_data[i];
@@ -164,7 +290,7 @@ bool inode_create(block_sector_t sector, off_t length, bool is_file)
 		void *dest = memcpy(&disk_inode->block, &inode.block, MEM_SIZE);
 		if (!dest)
 			success = false;
-		block_write(fs_device, sector, disk_inode);
+		buffer_write(sector, disk_inode, 0, BLOCK_SECTOR_SIZE, BUF_META);
 		free(disk_inode);
 	}
 	else
@@ -179,12 +305,15 @@ bool inode_create(block_sector_t sector, off_t length, bool is_file)
 struct inode *
 inode_open(block_sector_t sector)
 {
+#ifndef P4FILESYS
 	struct list_elem *e;
+#endif
 	struct inode *inode;
 #ifdef P4FILESYS
 	struct inode_disk inode_d;
 #endif
 
+#ifndef P4FILESYS
 	/* Check whether this inode is already open. */
 	for (e = list_begin(&open_inodes); e != list_end(&open_inodes); e =
 			list_next(e))
@@ -204,6 +333,39 @@ inode_open(block_sector_t sector)
 
 	/* Initialize. */
 	list_push_front(&open_inodes, &inode->elem);
+#else
+	struct inode key;
+	struct hash_elem *he;
+
+	/* Check whether this inode is open or recently closed. */
+	lock_acquire(&open_inodes_lock);
+	key.sector = sector;
+	he = hash_find(&open_inodes, &key.hash_elem);
+	if (he != NULL)
+	{
+		inode = hash_entry(he, struct inode, hash_elem);
+		if (inode->open_cnt == 0)
+		{
+			list_remove(&inode->elem);
+			closed_cnt--;
+		}
+		inode->open_cnt++;
+		while (inode->loading)
+			cond_wait(&inode_loaded, &open_inodes_lock);
+		lock_release(&open_inodes_lock);
+		return inode;
+	}
+
+	/* Allocate memory. */
+	inode = malloc(sizeof *inode);
+	if (inode == NULL)
+	{
+		lock_release(&open_inodes_lock);
+		return NULL;
+	}
+
+	/* Initialize. */
+#endif
 	inode->sector = sector;
 	inode->open_cnt = 1;
 	inode->deny_write_cnt = 0;
@@ -212,7 +374,11 @@ inode_open(block_sector_t sector)
 	block_read(fs_device, inode->sector, &inode->data);
 #endif
 #ifdef P4FILESYS
-	block_read(fs_device, inode->sector, &inode_d);
+	//in the table before it is read, so no one else reads it too
+	inode->loading = true;
+	hash_insert(&open_inodes, &inode->hash_elem);
+	lock_release(&open_inodes_lock);
+	buffer_read(inode->sector, &inode_d, 0, BLOCK_SECTOR_SIZE, BUF_META);
 	for (int i = 0; i < 10; i++)
 	{
 		if (i != LEN)
@@ -223,6 +389,15 @@ inode_open(block_sector_t sector)
 			inode->inode_data[LEN] = inode_d.length;
 	}
 	memcpy(&inode->block, &inode_d.block, MEM_SIZE);
+	lock_init(&inode->ib_lock);
+	rw_init(&inode->layout_lock);
+	inode->ib_sector = 0;
+	inode->dirty = false;
+
+	lock_acquire(&open_inodes_lock);
+	inode->loading = false;
+	cond_broadcast(&inode_loaded, &open_inodes_lock);
+	lock_release(&open_inodes_lock);
 #endif
 	return inode;
 }
@@ -232,7 +407,15 @@ struct inode *
 inode_reopen(struct inode *inode)
 {
 	if (inode != NULL)
+	{
+#ifdef P4FILESYS
+		lock_acquire(&open_inodes_lock);
+#endif
 		inode->open_cnt++;
+#ifdef P4FILESYS
+		lock_release(&open_inodes_lock);
+#endif
+	}
 	return inode;
 }
 
@@ -247,50 +430,72 @@ block_sector_t inode_get_inumber(const struct inode *inode)
  If INODE was also a removed inode, frees its blocks. */
 void inode_close(struct inode *inode)
 {
-#ifdef P4FILESYS
-	struct inode_disk inode_d;
-#endif
-
 	/* Ignore null pointer. */
 	if (inode == NULL)
 		return;
 
+#ifndef P4FILESYS
 	/* Release resources if this was the last opener. */
 	if (--inode->open_cnt == 0)
 	{
 		/* Remove from inode list and release lock. */
 		list_remove(&inode->elem);
 
-#ifdef P4FILESYS
-		if (!inode->removed)
-		{
-			inode_d.magic = INODE_MAGIC;
-			for (int i = 0; i < 10; i++)
-			{
-				if (i != LEN)
-					inode_d.inode_data[i] = inode->inode_data[i];
-				else
-					inode_d.length = inode->inode_data[LEN];
-			}
-			memcpy(&inode_d.block, &inode->block, MEM_SIZE);
-			block_write(fs_device, inode->sector, &inode_d);
-			free(inode);
-			return;
-		}
-#endif
-
 		/* Deallocate blocks if removed. */
 		if (inode->removed)
 		{
 			free_map_release(inode->sector, 1);
-#ifndef P4FILESYS
 			free_map_release(inode->data.start,
 					bytes_to_sectors(inode->data.length));
-#endif
-
 		}
 		free(inode);
 	}
+#else
+	//only a directory's bookkeeping waits for the close; the layout
+	//is written as soon as a write changes it.  Whoever marks the
+	//inode dirty or removed holds it open and closes it later, so
+	//closing a clean inode logs nothing
+	bool logged = inode->dirty || inode->removed;
+	if (logged)
+		journal_begin();
+	if (inode->dirty)
+	{
+		rw_read_acquire(&inode->layout_lock);
+		inode_write_disk(inode);
+		rw_read_release(&inode->layout_lock);
+	}
+
+	//whatever leaves the table is freed after the lock is dropped
+	struct inode *gone = NULL;
+	lock_acquire(&open_inodes_lock);
+	if (--inode->open_cnt == 0)
+	{
+		if (inode->removed)
+			gone = inode;
+		else
+		{
+			//keep it for a reopen, dropping the least recently closed
+			list_push_back(&closed_inodes, &inode->elem);
+			if (++closed_cnt > CLOSED_MAX)
+			{
+				gone = list_entry(list_pop_front(&closed_inodes),
+						struct inode, elem);
+				closed_cnt--;
+			}
+		}
+		if (gone != NULL)
+			hash_delete(&open_inodes, &gone->hash_elem);
+	}
+	lock_release(&open_inodes_lock);
+	if (gone != NULL)
+	{
+		if (gone->removed)
+			free_map_release(gone->sector, 1);
+		free(gone);
+	}
+	if (logged)
+		journal_end();
+#endif
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -311,6 +516,18 @@ off_t inode_read_at(struct inode *inode, void *buffer_, off_t size,
 	off_t bytes_read = 0;
 #ifndef P4FILESYS
 	uint8_t *bounce = NULL;
+#else
+	rw_read_acquire(&inode->layout_lock);
+	if (inode->inode_data[FMT] == FMT_INLINE)
+	{
+		if (offset >= inode_length(inode))
+			size = 0;
+		else if (size > inode_length(inode) - offset)
+			size = inode_length(inode) - offset;
+		memcpy(buffer, (uint8_t *) inode->block + offset, size);
+		rw_read_release(&inode->layout_lock);
+		return size;
+	}
 #endif
 
 	while (size > 0)
@@ -348,39 +565,11 @@ off_t inode_read_at(struct inode *inode, void *buffer_, off_t size,
 			memcpy(buffer + bytes_read, bounce + sector_ofs, chunk_size);
 		}
 #else
-		lock_acquire(&buffer_lock);
-		struct buffer_struct *bc = NULL;
-		int counter = 0;
-		for (struct list_elem *e = list_begin(&list_buffer);
-				e != list_end(&list_buffer); e = list_next(e))
-		{
-			struct buffer_struct *bc_temp = list_entry(e, struct buffer_struct,
-					buffer_listelem);
-			if (sector_idx == bc_temp->sector)
-			{
-				bc = bc_temp;
-				break;
-			}
-		}
-
-		while (bc == NULL)
-		{
-			bc = buffer_evict(sector_idx);
-			//try 100 times to get the block
-			if (counter++ == 100)
-				PANIC("Unable to allocate more buffer");
-		}
-
-		lock_release(&buffer_lock);
-
-		if (bc == NULL)
-			PANIC("In inode_read_at: Buffer cache entry in null");
+		if (sector_idx == 0)
+			memset(buffer + bytes_read, 0, chunk_size);
 		else
-			bc->access = true;
-		void *dest = memcpy((void *) buffer + bytes_read,
-				(void *) &bc->content + sector_ofs, (size_t) chunk_size);
-		if (!dest)
-			PANIC("In inode_read_at: memcpy failed");
+			buffer_read(sector_idx, buffer + bytes_read, sector_ofs, chunk_size,
+					inode_buf_type(inode));
 #endif
 
 		/* Advance. */
@@ -390,6 +579,8 @@ off_t inode_read_at(struct inode *inode, void *buffer_, off_t size,
 	}
 #ifndef P4FILESYS
 	free(bounce);
+#else
+	rw_read_release(&inode->layout_lock);
 #endif
 	return bytes_read;
 }
@@ -401,6 +592,60 @@ off_t inode_read_at(struct inode *inode, void *buffer_, off_t size,
  growth is not yet implemented.) */
 off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size,
 		off_t offset)
+{
+#ifndef P4FILESYS
+	return write_at(inode, buffer_, size, offset, NULL);
+#else
+	const uint8_t *buffer = buffer_;
+	off_t bytes_written = 0;
+
+	//growth and hole filling change the inode, so they are logged
+	//together with the index blocks and free map sectors they touch.
+	//the operation starts before the layout lock is taken, since
+	//journal_begin() may wait for a commit, which waits for every
+	//operation in progress to end
+	journal_begin();
+	while (size > 0)
+	{
+		off_t chunk = size < write_chunk(inode) ? size : write_chunk(inode);
+		off_t n;
+
+		//overwrites share the layout with readers; growing an inline
+		//file or past EOF changes it, so it takes the lock for writing
+		//up front
+		bool exclusive = inode->inode_data[FMT] == FMT_INLINE
+				|| offset + chunk > inode_length(inode);
+		if (exclusive)
+			rw_write_acquire(&inode->layout_lock);
+		else
+			rw_read_acquire(&inode->layout_lock);
+		n = write_at(inode, buffer + bytes_written, chunk, offset, &exclusive);
+		if (exclusive)
+			rw_write_release(&inode->layout_lock);
+		else
+			rw_read_release(&inode->layout_lock);
+
+		bytes_written += n;
+		offset += n;
+		size -= n;
+		if (n < chunk)
+			break;
+		//each chunk leaves the inode consistent, so the next may go in
+		//a transaction of its own
+		if (size > 0)
+			journal_restart();
+	}
+	journal_end();
+	return bytes_written;
+#endif
+}
+
+/* Does the work of inode_write_at().  Under P4FILESYS the caller
+ is in a journal operation and holds INODE's layout lock, for
+ writing if *EXCLUSIVE, which is upgraded before the layout is
+ changed. */
+static off_t write_at(struct inode *inode, const void *buffer_, off_t size,
+		off_t offset, bool *exclusive UNUSED)
 {
 	const uint8_t *buffer = buffer_;
 	off_t bytes_written = 0;
@@ -412,12 +657,33 @@ off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size,
 		return 0;
 
 #ifdef P4FILESYS
+	bool grown = false;
+	off_t filled = 0; //end of the sectors the last fill allocated
+	if (inode->inode_data[FMT] == FMT_INLINE)
+	{
+		layout_upgrade(inode, exclusive);
+		if (offset + size <= (off_t) INLINE_MAX)
+		{
+			memcpy((uint8_t *) inode->block + offset, buffer, size);
+			if (offset + size > inode_length(inode))
+				inode->inode_data[LEN] = offset + size;
+			inode_write_disk(inode);
+			return size;
+		}
+		inline_to_blocks(inode);
+	}
+	if (offset + size > inode_length(inode))
+		layout_upgrade(inode, exclusive);
 	if (offset + size > inode_length(inode))
 	{
 		size_t new_data_sectors = ((offset + size) / BLOCK_SECTOR_SIZE + 1)
 				- DIV_ROUND_UP(inode->inode_data[LEN], BLOCK_SECTOR_SIZE);
-		inode_expand(inode, offset + size, new_data_sectors);
-		inode->inode_data[LEN] = offset + size;
+		//on a full disk only the part before the old end is written
+		if (inode_expand(inode, offset + size, new_data_sectors))
+		{
+			inode->inode_data[LEN] = offset + size;
+			grown = true;
+		}
 	}
 #endif
 
@@ -464,41 +730,21 @@ off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size,
 			block_write(fs_device, sector_idx, bounce);
 		}
 #else
-		lock_acquire(&buffer_lock);
-		int counter = 0;
-		struct buffer_struct *bc = NULL;
-		for (struct list_elem *e = list_begin(&list_buffer);
-				e != list_end(&list_buffer); e = list_next(e))
+		//first write to a hole: allocate the rest of this write at once
+		if (sector_idx == 0)
 		{
-			struct buffer_struct *bc_temp = list_entry(e, struct buffer_struct,
-					buffer_listelem);
-			if (sector_idx == bc_temp->sector)
-			{
-				bc = bc_temp;
+			grown = true;
+			layout_upgrade(inode, exclusive);
+			if (byte_to_sector(inode, offset) == 0)
+				inode_fill(inode, offset,
+						DIV_ROUND_UP(sector_ofs + size, BLOCK_SECTOR_SIZE),
+						offset + size, &filled);
+			sector_idx = byte_to_sector(inode, offset);
+			if (sector_idx == 0)
 				break;
-			}
 		}
-
-		while (bc == NULL)
-		{
-			bc = buffer_evict(sector_idx);
-			//try 100 times to get the block
-			if (counter++ == 100)
-				PANIC("Unable to allocate more buffer");
-		}
-
-		lock_release(&buffer_lock);
-		if (bc == NULL)
-			PANIC("In inode_write_at: Buffer cache entry in null");
-		else
-		{
-			bc->dirty = true;
-			bc->access = true;
-		}
-		void *dest = memcpy((void *) &bc->content + sector_ofs,
-				(void *) buffer + bytes_written, (size_t) chunk_size);
-		if (!dest)
-			PANIC("In inode_write_at: memcpy failed");
+		buffer_write(sector_idx, buffer + bytes_written, sector_ofs,
+				chunk_size, inode_buf_type(inode));
 #endif
 
 		/* Advance. */
@@ -508,6 +754,15 @@ off_t inode_write_at(struct inode *inode, const void *buffer_, off_t size,
 	}
 #ifndef P4FILESYS
 	free(bounce);
+#else
+	//a write cut short leaves sectors allocated for bytes it never
+	//got to, which the fill did not zero, so they are zeroed now
+	for (offset = ROUND_UP(offset, BLOCK_SECTOR_SIZE); offset < filled;
+			offset += BLOCK_SECTOR_SIZE)
+		buffer_write(byte_to_sector(inode, offset), zeros, 0,
+				BLOCK_SECTOR_SIZE, inode_buf_type(inode));
+	if (grown)
+		inode_write_disk(inode);
 #endif
 	return bytes_written;
 }
@@ -541,87 +796,541 @@ off_t inode_length(struct inode *inode)
 }
 
 #ifdef P4FILESYS
-//function to allocate more blocks
-void inode_expand(struct inode *inode, off_t length, size_t new_data_sectors)
+//function to allocate more blocks.  returns false, leaving the
+//inode as it was, if the disk has no room for the index blocks
+bool inode_expand(struct inode *inode, off_t length, size_t new_data_sectors)
 {
 #ifndef P4FILESYS
 	panic("Wrong invocation of the function");
 #endif
+	if (inode->inode_data[FMT] == FMT_INLINE)
+	{
+		ASSERT(length <= (off_t) INLINE_MAX);
+		return true;
+	}
+	else if (inode->inode_data[FMT] == FMT_EXTENT)
+		return extent_expand(inode, length);
+	else
+		return indexed_expand(inode, new_data_sectors, NULL);
+}
+
+/* Grows INODE, which uses the indexed layout, by NEW_DATA_SECTORS
+ data sectors.  They are taken in order from GIVEN if it is
+ non-null, otherwise left as holes.  Returns false if an index
+ block cannot be allocated, after undoing the growth; sectors
+ from GIVEN then still belong to the caller.
+
+ A newly allocated index block is written like file data: nothing
+ committed points at it yet, so it may reach its home sector ahead
+ of the journal commit, and it can be evicted before then.  Only
+ the index blocks that already existed wait for the commit, so
+ however far INODE grows, the growth holds back at most three. */
+static bool indexed_expand(struct inode *inode, size_t new_data_sectors,
+		const block_sector_t *given)
+{
 	struct iblock_struct l1_block;
 	struct iblock_struct l2_block;
 	struct iblock_struct l3_block;
+	size_t old_sectors = indexed_sectors(inode);
 
-	if (new_data_sectors)
+	for (; new_data_sectors && inode->inode_data[I0] < I0_BLOCKS;
+			inode->inode_data[I0] += 1)
+	{
+		new_data_sectors -= 1;
+		data_sector_next(&inode->block[inode->inode_data[I0]], &given);
+	}
+	while (new_data_sectors && inode->inode_data[I0] < I0_BLOCKS + 1)
 	{
-		for (; new_data_sectors && inode->inode_data[I0] < I0_BLOCKS;
-				inode->inode_data[I0] += 1)
+		bool new_l1 = !inode->inode_data[I1];
+		if (!new_l1)
+			buffer_read(inode->block[inode->inode_data[I0]], &l1_block, 0,
+					BLOCK_SECTOR_SIZE, BUF_META);
+		else if (free_map_allocate_near(inode->sector, 1,
+				&inode->block[inode->inode_data[I0]]))
+			memset(&l1_block, 0, sizeof l1_block);
+		else
+			goto fail;
+
+		for (; new_data_sectors && inode->inode_data[I1] < 128;
+				inode->inode_data[I1]++)
 		{
 			new_data_sectors -= 1;
-			free_map_allocate(1, &inode->block[inode->inode_data[I0]]);
-			block_write(fs_device, inode->block[inode->inode_data[I0]], zeros);
+			data_sector_next(&l1_block.block[inode->inode_data[I1]], &given);
 		}
-		while (new_data_sectors && inode->inode_data[I0] < I0_BLOCKS + 1)
+		buffer_write(inode->block[inode->inode_data[I0]], &l1_block, 0,
+				BLOCK_SECTOR_SIZE, new_l1 ? BUF_DATA : BUF_META);
+		if (inode->inode_data[I1] >= 128)
 		{
-			if (inode->inode_data[I1])
-				block_read(fs_device, inode->block[inode->inode_data[I0]],
-						&l1_block);
+			inode->inode_data[I0] += 1;
+			inode->inode_data[I1] = 0;
+		}
+	}
+	while (new_data_sectors && inode->inode_data[I0] <= I0_BLOCKS + 1)
+	{
+		bool new_l2 = !inode->inode_data[I2] && !inode->inode_data[I1];
+		if (!new_l2)
+			buffer_read(inode->block[inode->inode_data[I0]], &l2_block, 0,
+					BLOCK_SECTOR_SIZE, BUF_META);
+		else if (free_map_allocate_near(inode->sector, 1,
+				&inode->block[inode->inode_data[I0]]))
+			memset(&l2_block, 0, sizeof l2_block);
+		else
+			goto fail;
+
+		while (new_data_sectors && inode->inode_data[I1] < 128)
+		{
+			bool new_l3 = !inode->inode_data[I2];
+			if (!new_l3)
+				buffer_read(l2_block.block[inode->inode_data[I1]], &l3_block,
+						0, BLOCK_SECTOR_SIZE, BUF_META);
+			else if (free_map_allocate_near(inode->sector, 1,
+					&l2_block.block[inode->inode_data[I1]]))
+				memset(&l3_block, 0, sizeof l3_block);
 			else
-				free_map_allocate(1, &inode->block[inode->inode_data[I0]]);
+			{
+				//an L2 block with nothing under it yet is not counted
+				//by indexed_sectors(), so it goes right away
+				if (inode->inode_data[I1] == 0)
+					free_map_release(inode->block[inode->inode_data[I0]], 1);
+				else
+					buffer_write(inode->block[inode->inode_data[I0]],
+							&l2_block, 0, BLOCK_SECTOR_SIZE,
+							new_l2 ? BUF_DATA : BUF_META);
+				goto fail;
+			}
 
-			for (; new_data_sectors && inode->inode_data[I1] < 128;
-					inode->inode_data[I1]++)
+			for (; new_data_sectors && inode->inode_data[I2] < 128;
+					inode->inode_data[I2]++)
 			{
 				new_data_sectors -= 1;
-				free_map_allocate(1, &l1_block.block[inode->inode_data[I1]]);
-				block_write(fs_device, l1_block.block[inode->inode_data[I1]],
-						zeros);
+				data_sector_next(&l3_block.block[inode->inode_data[I2]],
+						&given);
 			}
-			block_write(fs_device, inode->block[inode->inode_data[I0]],
-					&l1_block);
-			if (inode->inode_data[I1] >= 128)
+			buffer_write(l2_block.block[inode->inode_data[I1]], &l3_block,
+					0, BLOCK_SECTOR_SIZE, new_l3 ? BUF_DATA : BUF_META);
+			if (inode->inode_data[I2] >= 128)
 			{
-				inode->inode_data[I0] += 1;
-				inode->inode_data[I1] = 0;
+				inode->inode_data[I1] += 1;
+				inode->inode_data[I2] = 0;
 			}
 		}
-		while (new_data_sectors && inode->inode_data[I0] <= I0_BLOCKS + 1)
+		buffer_write(inode->block[inode->inode_data[I0]], &l2_block, 0,
+				BLOCK_SECTOR_SIZE, new_l2 ? BUF_DATA : BUF_META);
+	}
+	return true;
+
+	fail: indexed_shrink(inode, old_sectors);
+	return false;
+}
+
+/* Returns the number of data sectors, holes included, that INODE,
+ which uses the indexed layout, maps.  An index block exists for
+ every range of sectors this reaches into, and no other. */
+static size_t indexed_sectors(const struct inode *inode)
+{
+	if (inode->inode_data[I0] < I0_BLOCKS)
+		return inode->inode_data[I0];
+	if (inode->inode_data[I0] == I0_BLOCKS)
+		return I0_BLOCKS + inode->inode_data[I1];
+	return I0_BLOCKS + 128 + 128 * inode->inode_data[I1]
+			+ inode->inode_data[I2];
+}
+
+/* Cuts INODE, which uses the indexed layout, back to OLD_SECTORS
+ data sectors after a failed growth, releasing the index blocks
+ that only the sectors past them needed.  The data sectors are
+ left alone. */
+static void indexed_shrink(struct inode *inode, size_t old_sectors)
+{
+	size_t cnt = indexed_sectors(inode);
+	size_t first = I0_BLOCKS + 128; //first sector under the L2 block
+
+	if (old_sectors <= I0_BLOCKS && cnt > I0_BLOCKS)
+		free_map_release(inode->block[I0_BLOCKS], 1);
+	if (cnt > first)
+	{
+		struct iblock_struct l2_block;
+
+		buffer_read(inode->block[I0_BLOCKS + 1], &l2_block, 0,
+				BLOCK_SECTOR_SIZE, BUF_META);
+		for (size_t i = 0; first + 128 * i < cnt; i++)
+			if (first + 128 * i >= old_sectors)
+				free_map_release(l2_block.block[i], 1);
+		if (old_sectors <= first)
+			free_map_release(inode->block[I0_BLOCKS + 1], 1);
+	}
+
+	if (old_sectors < I0_BLOCKS)
+	{
+		inode->inode_data[I0] = old_sectors;
+		inode->inode_data[I1] = 0;
+		inode->inode_data[I2] = 0;
+	}
+	else if (old_sectors < first)
+	{
+		inode->inode_data[I0] = I0_BLOCKS;
+		inode->inode_data[I1] = old_sectors - I0_BLOCKS;
+		inode->inode_data[I2] = 0;
+	}
+	else
+	{
+		inode->inode_data[I0] = I0_BLOCKS + 1;
+		inode->inode_data[I1] = (old_sectors - first) / 128;
+		inode->inode_data[I2] = (old_sectors - first) % 128;
+	}
+	inode->ib_sector = 0;
+}
+
+/* Queues the READAHEAD_WINDOW sectors of INODE that follow the
+ one holding byte offset POS for the read-ahead thread.  Stops at
+ end of file. */
+void inode_read_ahead(struct inode *inode, off_t pos)
+{
+	off_t ofs = ROUND_UP(pos, BLOCK_SECTOR_SIZE);
+
+	rw_read_acquire(&inode->layout_lock);
+	for (uint32_t i = 0; i < readahead_window; i++)
+	{
+		if (inode->inode_data[FMT] == FMT_INLINE
+				|| ofs >= inode_length(inode))
+			break;
+		block_sector_t sector = byte_to_sector(inode, ofs);
+		if (sector != 0)
+			buffer_readahead(sector);
+		ofs += BLOCK_SECTOR_SIZE;
+	}
+	rw_read_release(&inode->layout_lock);
+}
+
+/* Stores the next data sector for a growing inode into *SECTORP:
+ the next of the *GIVEN sectors if GIVEN points to any, otherwise
+ 0, which leaves a hole for inode_fill() to allocate later. */
+static void data_sector_next(block_sector_t *sectorp,
+		const block_sector_t **given)
+{
+	if (*given != NULL)
+	{
+		*sectorp = **given;
+		*given += 1;
+	}
+	else
+		*sectorp = 0;
+}
+
+/* Grows INODE, which uses the extent layout, to cover LENGTH bytes.
+ The new sectors are a hole: a run with start 0 that inode_fill()
+ later splits as data is written.  If the extent table is full,
+ INODE is converted to the indexed layout and grown from there. */
+static bool extent_expand(struct inode *inode, off_t length)
+{
+	uint32_t cnt = inode->inode_data[I0];
+	size_t allocated = 0;
+	size_t needed;
+
+	for (uint32_t i = 0; i < cnt; i++)
+		allocated += inode->block[2 * i + 1];
+	needed = bytes_to_sectors(length);
+	if (allocated >= needed)
+		return true;
+
+	if (cnt > 0 && inode->block[2 * (cnt - 1)] == 0)
+		inode->block[2 * cnt - 1] += needed - allocated;
+	else if (cnt < EXTENT_CNT)
+	{
+		inode->block[2 * cnt] = 0;
+		inode->block[2 * cnt + 1] = needed - allocated;
+		inode->inode_data[I0] += 1;
+	}
+	else
+	{
+		if (!extent_to_indexed(inode))
+			return false;
+		return indexed_expand(inode, needed - allocated, NULL);
+	}
+	return true;
+}
+
+/* Writes the in-memory copy of INODE's on-disk inode back, into
+ the buffer cache. */
+static void inode_write_disk(struct inode *inode)
+{
+	struct inode_disk inode_d;
+
+	//cleared first, so a change made while copying stays dirty
+	inode->dirty = false;
+	inode_d.magic = INODE_MAGIC;
+	for (int i = 0; i < 10; i++)
+	{
+		if (i != LEN)
+			inode_d.inode_data[i] = inode->inode_data[i];
+		else
+			inode_d.length = inode->inode_data[LEN];
+	}
+	memcpy(&inode_d.block, &inode->block, MEM_SIZE);
+	buffer_write(inode->sector, &inode_d, 0, BLOCK_SECTOR_SIZE, BUF_META);
+}
+
+/* Moves the bytes of INODE, which uses the inline layout, out to
+ data sectors in the default layout, once it outgrows the inode
+ sector.  Called from inode_write_at(). */
+static void inline_to_blocks(struct inode *inode)
+{
+	uint8_t data[INLINE_MAX];
+	off_t length = inode_length(inode);
+	bool exclusive = true;
+
+	memcpy(data, inode->block, length);
+	memset(inode->block, 0, sizeof inode->block);
+	inode->inode_data[FMT] = inode_format;
+	inode->inode_data[I0] = 0;
+	inode->inode_data[I1] = 0;
+	inode->inode_data[I2] = 0;
+	inode->inode_data[LEN] = 0;
+	inode->ib_sector = 0;
+	if (length > 0)
+		write_at(inode, data, length, 0, &exclusive);
+}
+
+/* Makes sure the current thread holds INODE's layout lock for
+ writing, *EXCLUSIVE telling whether it already does.  The read
+ hold is dropped first, so callers recheck what they saw. */
+static void layout_upgrade(struct inode *inode, bool *exclusive)
+{
+	if (*exclusive)
+		return;
+	rw_read_release(&inode->layout_lock);
+	rw_write_acquire(&inode->layout_lock);
+	*exclusive = true;
+}
+
+/* Zeroes the CNT sectors starting at SECTOR, newly allocated to
+ INODE for the bytes starting at OFS, in the buffer cache, except
+ those that the write of bytes POS up to END is about to cover
+ whole.  Only the sectors the write covers partly, at its head and
+ tail, need zeros under it. */
+static void sector_zero(struct inode *inode, block_sector_t sector,
+		off_t ofs, size_t cnt, off_t pos, off_t end)
+{
+	for (size_t i = 0; i < cnt; i++, ofs += BLOCK_SECTOR_SIZE)
+		if (ofs < pos || ofs + BLOCK_SECTOR_SIZE > end)
+			buffer_write(sector + i, zeros, 0, BLOCK_SECTOR_SIZE,
+					inode_buf_type(inode));
+}
+
+/* Allocates data sectors for the hole at sector N of INODE, which
+ uses the extent layout, covering at most CNT sectors, for a write
+ of bytes POS up to END.  The run before the hole is grown in place
+ if possible, so sequential writes stay in one extent.  Returns the
+ number of sectors allocated, 0 if the extent table has no room to
+ split the hole, or -1 if the disk is full. */
+static int extent_fill(struct inode *inode, uint32_t n, size_t cnt,
+		off_t pos, off_t end)
+{
+	off_t ofs = (off_t) n * BLOCK_SECTOR_SIZE;
+	uint32_t *block = inode->block;
+	uint32_t extents = inode->inode_data[I0];
+	uint32_t i;
+	block_sector_t start;
+	size_t run, hole;
+
+	for (i = 0; i < extents && n >= block[2 * i + 1]; i++)
+		n -= block[2 * i + 1];
+	ASSERT(i < extents && block[2 * i] == 0);
+	hole = block[2 * i + 1];
+	if (cnt > hole - n)
+		cnt = hole - n;
+
+	start = i > 0 ? block[2 * (i - 1)] + block[2 * i - 1] : 0;
+	if (n == 0 && i > 0 && block[2 * (i - 1)] != 0
+			&& (run = free_map_extend(start, cnt)) > 0)
+	{
+		block[2 * i - 1] += run;
+		block[2 * i + 1] -= run;
+		if (block[2 * i + 1] == 0)
+		{
+			memmove(&block[2 * i], &block[2 * (i + 1)],
+					(extents - i - 1) * 2 * sizeof *block);
+			inode->inode_data[I0] -= 1;
+		}
+	}
+	else
+	{
+		//the hole becomes up to three runs: hole, data, hole
+		size_t extra = (n > 0) + 1;
+		if (extents + extra > EXTENT_CNT)
+			return 0;
+		run = free_map_allocate_run(start ? start : inode->sector, cnt, &start);
+		if (run == 0)
+			return -1;
+		extra = (n > 0) + (hole - n - run > 0);
+		memmove(&block[2 * (i + 1 + extra)], &block[2 * (i + 1)],
+				(extents - i - 1) * 2 * sizeof *block);
+		if (n > 0)
+		{
+			block[2 * i + 1] = n;
+			i++;
+		}
+		block[2 * i] = start;
+		block[2 * i + 1] = run;
+		if (hole - n - run > 0)
 		{
+			block[2 * (i + 1)] = 0;
+			block[2 * (i + 1) + 1] = hole - n - run;
+		}
+		inode->inode_data[I0] += extra;
+	}
+	sector_zero(inode, start, ofs, run, pos, end);
+	return run;
+}
 
-			if (inode->inode_data[I2] || inode->inode_data[I1])
-				block_read(fs_device, inode->block[inode->inode_data[I0]],
-						&l2_block);
-			else
-				free_map_allocate(1, &inode->block[inode->inode_data[I0]]);
+/* Allocates a data sector for the hole holding byte offset POS of
+ INODE, which uses the indexed layout, preferably right after the
+ sector before it, for a write of bytes WRITE_POS up to WRITE_END.
+ Returns false if the disk is full. */
+static bool indexed_fill(struct inode *inode, off_t pos, off_t write_pos,
+		off_t write_end)
+{
+	off_t i0_limit = BLOCK_SECTOR_SIZE * I0_BLOCKS;
+	off_t i1_limit = BLOCK_SECTOR_SIZE * (I0_BLOCKS + 128);
+	block_sector_t prev = 0;
+	block_sector_t sector;
 
-			while (new_data_sectors && inode->inode_data[I1] < 128)
-			{
-				if (inode->inode_data[I2])
-					block_read(fs_device, l2_block.block[inode->inode_data[I1]],
-							&l3_block);
-				else
-					free_map_allocate(1, &l2_block.block[inode->inode_data[I1]]);
+	if (pos > 0)
+		prev = byte_to_sector(inode, pos - BLOCK_SECTOR_SIZE);
 
-				for (; new_data_sectors && inode->inode_data[I2] < 128;
-						inode->inode_data[I2]++)
-				{
-					new_data_sectors -= 1;
-					free_map_allocate(1, &l3_block.block[inode->inode_data[I2]]);
-					block_write(fs_device, l3_block.block[inode->inode_data[I2]],
-							zeros);
-				}
-				block_write(fs_device, l2_block.block[inode->inode_data[I1]],
-						&l3_block);
-				if (inode->inode_data[I2] >= 128)
-				{
-					inode->inode_data[I1] += 1;
-					inode->inode_data[I2] = 0;
-				}
+	if (prev != 0 && free_map_extend(prev + 1, 1) == 1)
+		sector = prev + 1;
+	else if (!free_map_allocate_near(prev ? prev : inode->sector, 1, &sector))
+		return false;
+	sector_zero(inode, sector, pos, 1, write_pos, write_end);
+
+	if (pos < i0_limit)
+		inode->block[pos / BLOCK_SECTOR_SIZE] = sector;
+	else if (pos < i1_limit)
+	{
+		pos -= i0_limit;
+		buffer_write(inode->block[I0_BLOCKS],
+				&sector, pos / BLOCK_SECTOR_SIZE * sizeof(uint32_t),
+				sizeof(uint32_t), BUF_META);
+	}
+	else
+	{
+		block_sector_t l2_sector;
+		pos -= i1_limit;
+		buffer_read(inode->block[114], &l2_sector,
+				pos / (BLOCK_SECTOR_SIZE * 128) * sizeof(uint32_t),
+				sizeof(uint32_t), BUF_META);
+		buffer_write(l2_sector, &sector,
+				(pos % (BLOCK_SECTOR_SIZE * 128)) / BLOCK_SECTOR_SIZE
+						* sizeof(uint32_t), sizeof(uint32_t), BUF_META);
+	}
+	return true;
+}
+
+/* Allocates data sectors for the hole of INODE holding byte offset
+ POS, up to CNT sectors of it, stopping at the first sector already
+ allocated.  Called on the first write to a hole, of bytes POS up
+ to WRITE_END; sectors it overwrites whole are not zeroed first.
+ If ENDP is non-null, stores the end of the sectors allocated into
+ *ENDP, so the caller can zero those it did not write after all.
+ Returns false if the disk is full. */
+static bool inode_fill(struct inode *inode, off_t pos, size_t cnt,
+		off_t write_end, off_t *endp)
+{
+	bool success = true;
+	off_t write_pos = pos;
+
+	pos = pos / BLOCK_SECTOR_SIZE * BLOCK_SECTOR_SIZE;
+	while (cnt > 0 && pos < inode_length(inode)
+			&& byte_to_sector(inode, pos) == 0)
+	{
+		int run = 1;
+
+		if (inode->inode_data[FMT] == FMT_INDEXED)
+			success = indexed_fill(inode, pos, write_pos, write_end);
+		else
+		{
+			run = extent_fill(inode, pos / BLOCK_SECTOR_SIZE, cnt, write_pos,
+					write_end);
+			if (run == 0)
+			{
+				success = extent_to_indexed(inode);
+				if (success)
+					continue;
 			}
-			block_write(fs_device, inode->block[inode->inode_data[I0]],
-					&l2_block);
+			else if (run < 0)
+				success = false;
 		}
+		if (!success)
+			break;
+		pos += run * BLOCK_SECTOR_SIZE;
+		cnt -= run;
 	}
-	return;
+	if (endp != NULL)
+		*endp = pos;
+	return success;
+}
+
+/* Rewrites INODE's extents as an indexed block map, keeping its
+ data sectors where they are.  The sectors are handed to
+ indexed_expand() a batch at a time, walking a copy of the extent
+ table.  Returns false, leaving INODE as it was, if out of memory
+ or if the disk has no room for the index blocks. */
+static bool extent_to_indexed(struct inode *inode)
+{
+	block_sector_t batch[32];
+	uint32_t *extents;
+	uint32_t cnt = inode->inode_data[I0];
+	size_t n = 0;
+
+	extents = malloc(sizeof inode->block);
+	if (extents == NULL)
+		return false;
+	memcpy(extents, inode->block, sizeof inode->block);
+
+	inode->inode_data[FMT] = FMT_INDEXED;
+	inode->inode_data[I0] = 0;
+	inode->inode_data[I1] = 0;
+	inode->inode_data[I2] = 0;
+	memset(inode->block, 0, sizeof inode->block);
+	inode->ib_sector = 0;
+	for (uint32_t i = 0; i < cnt; i++)
+		for (uint32_t j = 0; j < extents[2 * i + 1]; j++)
+		{
+			batch[n++] = extents[2 * i] ? extents[2 * i] + j : 0;
+			if (n == sizeof batch / sizeof *batch)
+			{
+				if (!indexed_expand(inode, n, batch))
+					goto fail;
+				n = 0;
+			}
+		}
+	if (n > 0 && !indexed_expand(inode, n, batch))
+		goto fail;
+	free(extents);
+	return true;
+
+	fail: indexed_shrink(inode, 0);
+	inode->inode_data[FMT] = FMT_EXTENT;
+	inode->inode_data[I0] = cnt;
+	inode->inode_data[I1] = 0;
+	inode->inode_data[I2] = 0;
+	memcpy(inode->block, extents, sizeof inode->block);
+	inode->ib_sector = 0;
+	free(extents);
+	return false;
+}
+
+static unsigned inode_hash(const struct hash_elem *e, void *aux UNUSED)
+{
+	return hash_int(hash_entry(e, struct inode, hash_elem)->sector);
+}
+
+static bool inode_less(const struct hash_elem *a, const struct hash_elem *b,
+		void *aux UNUSED)
+{
+	return hash_entry(a, struct inode, hash_elem)->sector
+			< hash_entry(b, struct inode, hash_elem)->sector;
 }
 
 uint32_t inode_op(int operation, struct inode * inode)
@@ -638,6 +1347,9 @@ uint32_t inode_op(int operation, struct inode * inode)
 	case OP_PARENT:
 		return_val = inode->inode_data[PAR];
 		break;
+	case OP_FORMAT:
+		return_val = inode->inode_data[FMT];
+		break;
 	default:
 		return_val = false;
 	}
@@ -5,11 +5,16 @@
 #include "filesys/off_t.h"
 #include "devices/block.h"
 #include <list.h>
+#ifdef P4FILESYS
+#include <hash.h>
+#include "threads/synch.h"
+#endif
 
 //various operations needed to be  performed
 #define OP_ISDIR 0
 #define OP_PARENT 1
 #define OP_OPENCNT 2
+#define OP_FORMAT 3
 
 //defines data to be stored in inode_disk
 #define I0 0
@@ -20,8 +25,17 @@
 #define DIR 5
 #define LEN 6
 #define SIZE 7
+#define FMT 8
+#define HASH 9  /* Occupied slots of a hashed directory; 0 if linear. */
+
+//layouts of block[], recorded in inode_data[FMT]
+#define FMT_INDEXED 0   /* Direct, indirect and doubly indirect blocks. */
+#define FMT_EXTENT 1    /* (start, length) runs; inode_data[I0] in use. */
+#define FMT_INLINE 2    /* The file's bytes themselves. */
+#define EXTENT_CNT 57
 
 #define MEM_SIZE (115 * sizeof(uint32_t))
+#define INLINE_MAX MEM_SIZE /* Longest file kept in block[]. */
 char zeros[BLOCK_SECTOR_SIZE];
 
 #define I0_BLOCKS 113
@@ -46,7 +60,8 @@ struct inode_disk
 /* In-memory inode. */
 struct inode
 {
-	struct list_elem elem; /* Element in inode list. */
+	struct list_elem elem; /* Element in inode list, or in the LRU
+	 list of closed inodes if P4FILESYS. */
 	block_sector_t sector; /* Sector number of disk location. */
 	int open_cnt; /* Number of openers. */
 	bool removed; /* True if deleted, false otherwise. */
@@ -56,6 +71,18 @@ struct inode
 #ifdef P4FILESYS
 	uint32_t inode_data[10];
 	uint32_t block[115];
+	struct hash_elem hash_elem; /* Element in open_inodes. */
+	bool dirty; /* Changed since last written to its sector. */
+	bool loading; /* Being read in by inode_open(). */
+
+	//held for reading while the layout (FMT, LEN, block[]) is used to
+	//find data, and for writing while it is changed
+	struct rwlock layout_lock;
+
+	//copy of the last indirect block used by byte_to_sector()
+	struct lock ib_lock;
+	block_sector_t ib_sector; //0 if nothing is cached
+	uint32_t ib_block[128];
 #endif
 };
 
@@ -67,6 +94,7 @@ bool inode_create(block_sector_t, off_t);
 #else
 bool inode_create(block_sector_t, off_t, bool);
 #endif
+uint32_t byte_to_sector(struct inode *inode, off_t pos);
 struct inode *inode_open(block_sector_t);
 struct inode *inode_reopen(struct inode *);
 block_sector_t inode_get_inumber(const struct inode *);
@@ -78,6 +106,13 @@ void inode_deny_write(struct inode *);
 void inode_allow_write(struct inode *);
 off_t inode_length(struct inode *);
 
-void inode_expand(struct inode *inode, off_t length, size_t new_data_sectors);
+bool inode_expand(struct inode *inode, off_t length, size_t new_data_sectors);
+#ifdef P4FILESYS
+void inode_read_ahead(struct inode *inode, off_t pos);
+
+/* -extents: Layout given to new inodes.  Taken from the free map
+ inode when an existing file system is opened. */
+extern int inode_format;
+#endif
 
 #endif /* filesys/inode.h */
@@ -0,0 +1,291 @@
+#include "filesys/journal.h"
+#ifdef P4FILESYS
+#include <debug.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/shutdown.h"
+#include "filesys/free-map.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+
+/* Metadata write-ahead journal.
+
+ File system operations that change metadata run between
+ journal_begin() and journal_end().  The write-behind thread
+ commits all of them at once: journal_quiesce() waits for the
+ operations in progress to finish and holds off new ones while
+ the dirty metadata in the buffer cache is copied out, after
+ which journal_resume() lets them continue.  Those copies are
+ then written to the journal as one sequential run, committed by
+ writing the header that lists their home sectors, written to
+ their home sectors, and released by clearing the header again.
+ After a crash, journal_recover() replays a committed header, so
+ each commit reaches the disk entirely or not at all.
+
+ A disk formatted before the journal existed gets one when it is
+ mounted if the journal region is still free.  Otherwise its
+ metadata keeps being written in place, without a journal. */
+
+#define JOURNAL_MAGIC 0x4a524e4c
+#define JOURNAL_MAX (JOURNAL_SECTORS - 1)
+
+/* Uncommitted metadata sectors, counting those the operations in
+ progress have reserved, past which journal_begin() commits first.
+ Those sectors cannot be evicted, so this leaves the rest of the
+ buffer cache to reading and to data. */
+#define JOURNAL_DIRTY_MAX (BUFFER_SIZE / 2)
+
+/* On-disk journal header.
+ Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct journal_header
+{
+	unsigned magic;
+	uint32_t seq; /* Commit sequence number. */
+	uint32_t cnt; /* Committed sectors, 0 if none. */
+	block_sector_t sectors[125]; /* Home sector of each copy. */
+};
+
+static struct lock journal_lock;
+static struct condition journal_quiet; /* No operations running. */
+static struct condition journal_open; /* No commit being taken. */
+static int journal_active; /* Operations running. */
+static size_t journal_reserved; /* Credits they hold. */
+static bool journal_committing;
+static uint32_t journal_seq;
+static bool journal_enabled; /* The disk has a journal region. */
+static bool journal_closing; /* The final commit is being taken. */
+
+/* -jcrash: power off right after the final commit, before any of
+ it is written home, as if the power had failed there. */
+bool journal_crash;
+
+static unsigned long long journal_commits;
+static unsigned long long journal_logged;
+
+/* Initializes the journal module. */
+void journal_init(void)
+{
+	ASSERT(sizeof(struct journal_header) == BLOCK_SECTOR_SIZE);
+	ASSERT(JOURNAL_MAX <= 125);
+
+	lock_init(&journal_lock);
+	cond_init(&journal_quiet);
+	cond_init(&journal_open);
+	journal_active = 0;
+	journal_reserved = 0;
+	journal_committing = false;
+	journal_seq = 0;
+	journal_enabled = false;
+	journal_closing = false;
+}
+
+/* Writes an empty journal header while formatting. */
+void journal_format(void)
+{
+	journal_enabled = true;
+	journal_checkpoint();
+}
+
+/* Replays the last commit if the system stopped before it reached
+ its home sectors.  Called before anything else reads the disk. */
+void journal_recover(void)
+{
+	struct journal_header h;
+	uint8_t block[BLOCK_SECTOR_SIZE];
+
+	block_read(fs_device, JOURNAL_SECTOR, &h);
+	if (h.magic != JOURNAL_MAGIC)
+	{
+		printf("File system has no journal.\n");
+		return;
+	}
+	journal_enabled = true;
+	journal_seq = h.seq;
+	if (h.cnt == 0)
+		return;
+
+	printf("Replaying journal commit %u (%u sectors)...\n", h.seq, h.cnt);
+	for (uint32_t i = 0; i < h.cnt && i < JOURNAL_MAX; i++)
+	{
+		block_read(fs_device, JOURNAL_SECTOR + 1 + i, block);
+		block_write(fs_device, h.sectors[i], block);
+	}
+	journal_checkpoint();
+}
+
+/* Gives a disk that journal_recover() found without a journal one,
+ if the journal region is free in its free map.  The region is
+ claimed and the free map written home before the header, so a
+ crash in between cannot leave a journal over file data.  Called
+ once the free map is open. */
+void journal_attach(void)
+{
+	size_t n;
+
+	if (journal_enabled)
+		return;
+	n = free_map_extend(JOURNAL_SECTOR, JOURNAL_SECTORS);
+	if (n < JOURNAL_SECTORS)
+	{
+		if (n > 0)
+			free_map_release(JOURNAL_SECTOR, n);
+		printf("Journal region in use: metadata is written "
+				"without a journal.\n");
+		return;
+	}
+	buffer_flush();
+	journal_format();
+	printf("Formatted journal in sectors %u-%u.\n", JOURNAL_SECTOR,
+			JOURNAL_SECTOR + JOURNAL_SECTORS - 1);
+}
+
+/* Marks the next commit as the last one before shutdown. */
+void journal_close(void)
+{
+	journal_closing = true;
+}
+
+/* Starts a metadata operation that changes at most JOURNAL_CREDITS
+ metadata sectors, first waiting for a commit being taken to be
+ copied out.  If the metadata waiting for a commit leaves no room
+ for that, waits for the operations in progress to end and takes a
+ commit; an operation in progress could not, since a commit waits
+ for all of them to end.  Calls may nest. */
+void journal_begin(void)
+{
+	struct thread *t = thread_current();
+	bool flushed = false;
+
+	if (t->journal_depth++ > 0)
+		return;
+	lock_acquire(&journal_lock);
+	for (;;)
+	{
+		while (journal_committing)
+			cond_wait(&journal_open, &journal_lock);
+		if (flushed || buffer_meta_dirty() + journal_reserved
+				+ JOURNAL_CREDITS <= JOURNAL_DIRTY_MAX)
+			break;
+		if (journal_active > 0)
+			cond_wait(&journal_quiet, &journal_lock);
+		else
+		{
+			lock_release(&journal_lock);
+			buffer_flush();
+			lock_acquire(&journal_lock);
+			flushed = true;
+		}
+	}
+	journal_active++;
+	journal_reserved += JOURNAL_CREDITS;
+	lock_release(&journal_lock);
+}
+
+/* Ends a metadata operation started by journal_begin(). */
+void journal_end(void)
+{
+	struct thread *t = thread_current();
+
+	ASSERT(t->journal_depth > 0);
+	if (--t->journal_depth > 0)
+		return;
+	lock_acquire(&journal_lock);
+	journal_reserved -= JOURNAL_CREDITS;
+	if (--journal_active == 0)
+		cond_broadcast(&journal_quiet, &journal_lock);
+	lock_release(&journal_lock);
+}
+
+/* Ends the calling thread's operation, however deeply nested, and
+ starts it again with fresh credits, committing first if the
+ metadata it changed leaves no room.  What it did so far may then
+ reach the disk without the rest, so it must be called between
+ steps that each leave the file system consistent, and without
+ holding a lock that an operation in progress may wait for. */
+void journal_restart(void)
+{
+	struct thread *t = thread_current();
+	int depth = t->journal_depth;
+
+	ASSERT(depth > 0);
+	t->journal_depth = 1;
+	journal_end();
+	journal_begin();
+	t->journal_depth = depth;
+}
+
+/* Waits until no metadata operation is running and keeps new ones
+ from starting until journal_resume().  Operations on the calling
+ thread are not held off, so it may write metadata meanwhile. */
+void journal_quiesce(void)
+{
+	lock_acquire(&journal_lock);
+	while (journal_committing)
+		cond_wait(&journal_open, &journal_lock);
+	journal_committing = true;
+	thread_current()->journal_depth++;
+	while (journal_active > 0)
+		cond_wait(&journal_quiet, &journal_lock);
+	lock_release(&journal_lock);
+}
+
+/* Lets metadata operations start again. */
+void journal_resume(void)
+{
+	lock_acquire(&journal_lock);
+	thread_current()->journal_depth--;
+	journal_committing = false;
+	cond_broadcast(&journal_open, &journal_lock);
+	lock_release(&journal_lock);
+}
+
+/* Writes the CNT sectors in BLOCKS to the journal and commits them
+ for home sectors SECTORS.  The caller then writes them home and
+ calls journal_checkpoint(). */
+void journal_commit(const block_sector_t *sectors, const void *blocks,
+		size_t cnt)
+{
+	struct journal_header h;
+
+	ASSERT(cnt <= JOURNAL_MAX);
+	if (cnt == 0 || !journal_enabled)
+		return;
+	block_write_multi(fs_device, JOURNAL_SECTOR + 1, cnt, blocks);
+
+	memset(&h, 0, sizeof h);
+	h.magic = JOURNAL_MAGIC;
+	h.seq = ++journal_seq;
+	h.cnt = cnt;
+	memcpy(h.sectors, sectors, cnt * sizeof *sectors);
+	block_write(fs_device, JOURNAL_SECTOR, &h);
+
+	journal_commits++;
+	journal_logged += cnt;
+
+	if (journal_crash && journal_closing)
+	{
+		printf("Crashing after journal commit %u.\n", h.seq);
+		shutdown_crash();
+	}
+}
+
+/* Marks the journal empty once the last commit is home. */
+void journal_checkpoint(void)
+{
+	struct journal_header h;
+
+	if (!journal_enabled)
+		return;
+	memset(&h, 0, sizeof h);
+	h.magic = JOURNAL_MAGIC;
+	h.seq = journal_seq;
+	block_write(fs_device, JOURNAL_SECTOR, &h);
+}
+
+/* Prints journal statistics. */
+void journal_print_stats(void)
+{
+	printf("Journal: %llu commits, %llu sectors logged\n", journal_commits,
+			journal_logged);
+}
+#endif
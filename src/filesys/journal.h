@@ -0,0 +1,41 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#ifdef P4FILESYS
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
+#include "filesys/filesys.h"
+
+/* The journal region: a header sector followed by room for one
+ copy of every sector the buffer cache can hold. */
+#define JOURNAL_SECTOR 2
+#define JOURNAL_SECTORS (1 + BUFFER_SIZE)
+
+/* Metadata sectors journal_begin() reserves for an operation.  One
+ that may change more, such as a large write, runs as several
+ transactions, calling journal_restart() in between. */
+#define JOURNAL_CREDITS 8
+
+extern bool journal_crash;
+
+void journal_init(void);
+void journal_format(void);
+void journal_recover(void);
+void journal_attach(void);
+void journal_close(void);
+
+void journal_begin(void);
+void journal_end(void);
+void journal_restart(void);
+
+void journal_quiesce(void);
+void journal_resume(void);
+void journal_commit(const block_sector_t *sectors, const void *blocks,
+		size_t cnt);
+void journal_checkpoint(void);
+
+void journal_print_stats(void);
+#endif
+
+#endif /* filesys/journal.h */
@@ -0,0 +1,44 @@
+/* Grows a file by several megabytes in a single write, by seeking
+   far past its end, and checks that it reads back as zeros up to
+   the byte written.  The growth touches more index blocks than the
+   buffer cache holds. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_SIZE (4 * 1024 * 1024)
+
+static char buf[4096];
+
+void
+test_main (void) 
+{
+  const char *file_name = "testfile";
+  char one = 1;
+  size_t ofs;
+  int fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  msg ("seek \"%s\"", file_name);
+  seek (fd, FILE_SIZE - 1);
+  CHECK (write (fd, &one, 1) == 1, "write \"%s\"", file_name);
+  CHECK (filesize (fd) == FILE_SIZE, "filesize \"%s\"", file_name);
+
+  msg ("read \"%s\"", file_name);
+  seek (fd, 0);
+  for (ofs = 0; ofs < FILE_SIZE; ofs += sizeof buf)
+    {
+      size_t i;
+
+      if (read (fd, buf, sizeof buf) != sizeof buf)
+        fail ("read %zu bytes at offset %zu in \"%s\" failed",
+              sizeof buf, ofs, file_name);
+      for (i = 0; i < sizeof buf; i++)
+        if (buf[i] != (ofs + i == FILE_SIZE - 1))
+          fail ("byte %zu of \"%s\" is %d", ofs + i, file_name, buf[i]);
+    }
+  msg ("close \"%s\"", file_name);
+  close (fd);
+}
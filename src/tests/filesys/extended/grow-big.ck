@@ -0,0 +1,16 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(grow-big) begin
+(grow-big) create "testfile"
+(grow-big) open "testfile"
+(grow-big) seek "testfile"
+(grow-big) write "testfile"
+(grow-big) filesize "testfile"
+(grow-big) read "testfile"
+(grow-big) close "testfile"
+(grow-big) end
+EOF
+pass;
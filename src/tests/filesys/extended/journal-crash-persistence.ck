@@ -0,0 +1,8 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+fail "journal was not replayed on the extraction run\n"
+  if !grep (/^Replaying journal commit/, read_text_file ("$test.output"));
+check_archive ({'a' => {'b' => ['j' x 4096]}});
+pass;
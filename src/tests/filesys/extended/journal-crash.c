@@ -0,0 +1,25 @@
+/* Writes a directory, a file in it and the file's contents, then
+   shuts down with -jcrash, which powers off after the last journal
+   commit but before that metadata is written home.  The persistence
+   check verifies that the next boot replays the commit. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+static char buf[4096];
+
+void
+test_main (void) 
+{
+  int fd;
+
+  memset (buf, 'j', sizeof buf);
+  CHECK (mkdir ("a"), "mkdir \"a\"");
+  CHECK (create ("a/b", 0), "create \"a/b\"");
+  CHECK ((fd = open ("a/b")) > 1, "open \"a/b\"");
+  CHECK (write (fd, buf, sizeof buf) == sizeof buf, "write \"a/b\"");
+  msg ("close \"a/b\"");
+  close (fd);
+}
@@ -0,0 +1,14 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(journal-crash) begin
+(journal-crash) mkdir "a"
+(journal-crash) create "a/b"
+(journal-crash) open "a/b"
+(journal-crash) write "a/b"
+(journal-crash) close "a/b"
+(journal-crash) end
+EOF
+pass;
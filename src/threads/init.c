@@ -36,8 +36,11 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "devices/ramdisk.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/inode.h"
+#include "filesys/journal.h"
 #endif
 
 #ifdef VM
@@ -60,6 +63,12 @@ static const char *scratch_bdev_name;
 #ifdef VM
 static const char *swap_bdev_name;
 #endif
+
+/* -ramdisk: Size of RAM disk in kB, or 0 for none. */
+static size_t ramdisk_kb;
+
+/* -iostats: Seconds between I/O statistics reports, or 0 for none. */
+static int iostats_interval;
 #endif /* FILESYS */
 
 /* -ul: Maximum number of pages to put into palloc's user pool. */
@@ -76,6 +85,9 @@ static void usage(void);
 #ifdef FILESYS
 static void locate_block_devices (void);
 static void locate_block_device (enum block_type, const char *name);
+#ifdef VM
+static void locate_swap_device (const char *name);
+#endif
 #endif
 
 int main(void) NO_RETURN;
@@ -130,7 +142,10 @@ int main(void)
 #ifdef FILESYS
 	/* Initialize file system. */
 	ide_init ();
+	ramdisk_init (ramdisk_kb);
 	locate_block_devices ();
+	if (iostats_interval > 0)
+		block_stats_start (iostats_interval);
 	filesys_init (format_filesys);
 #endif
 
@@ -256,6 +271,20 @@ parse_options(char **argv)
 		filesys_bdev_name = value;
 		else if (!strcmp (name, "-scratch"))
 		scratch_bdev_name = value;
+		else if (!strcmp (name, "-pio"))
+		ide_dma = false;
+		else if (!strcmp (name, "-ramdisk"))
+		ramdisk_kb = atoi (value);
+		else if (!strcmp (name, "-iostats"))
+		iostats_interval = atoi (value);
+#ifdef P4FILESYS
+		else if (!strcmp (name, "-ra"))
+		readahead_window = atoi (value);
+		else if (!strcmp (name, "-extents"))
+		inode_format = FMT_EXTENT;
+		else if (!strcmp (name, "-jcrash"))
+		journal_crash = true;
+#endif
 #ifdef VM
 		else if (!strcmp (name, "-swap"))
 		swap_bdev_name = value;
@@ -397,6 +426,15 @@ static void usage(void)
 			"  -f                 Format file system device during startup.\n"
 			"  -filesys=BDEV      Use BDEV for file system instead of default.\n"
 			"  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+			"  -pio               Use PIO instead of DMA for IDE disks.\n"
+			"  -ramdisk=KB        Create RAM disk ram0 of KB kB, e.g. -filesys=ram0.\n"
+			"  -iostats=SECS      Print block device I/O statistics every SECS.\n"
+#ifdef P4FILESYS
+			"  -ra=SECTORS        Read SECTORS ahead of sequential reads (0=off).\n"
+			"  -extents           With -f, allocate files in extents.\n"
+			"  -jcrash            Power off between the final journal commit\n"
+			"                     and its checkpoint, to test recovery.\n"
+#endif
 #ifdef VM
 			"  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
@@ -418,7 +456,7 @@ locate_block_devices (void)
 	locate_block_device (BLOCK_FILESYS, filesys_bdev_name);
 	locate_block_device (BLOCK_SCRATCH, scratch_bdev_name);
 #ifdef VM
-	locate_block_device (BLOCK_SWAP, swap_bdev_name);
+	locate_swap_device (swap_bdev_name);
 #endif
 }
 
@@ -450,4 +488,30 @@ locate_block_device (enum block_type role, const char *name)
 		block_set_role (role, block);
 	}
 }
+
+#ifdef VM
+/* Figures out what block device to use for swap, like
+ locate_block_device(), but if NAME is null prefers a swap
+ device on a different I/O channel from the file system, so
+ that paging and file I/O can transfer at the same time. */
+static void
+locate_swap_device (const char *name)
+{
+	struct block *fs = block_get_role (BLOCK_FILESYS);
+	struct block *block;
+
+	if (name == NULL && fs != NULL && block_channel (fs) != NULL)
+		for (block = block_first (); block != NULL; block = block_next (block))
+			if (block_type (block) == BLOCK_SWAP
+					&& block_channel (block) != block_channel (fs))
+			{
+				printf ("%s: using %s\n", block_type_name (BLOCK_SWAP),
+						block_name (block));
+				block_set_role (BLOCK_SWAP, block);
+				return;
+			}
+
+	locate_block_device (BLOCK_SWAP, name);
+}
+#endif
 #endif
@@ -148,6 +148,30 @@ palloc_free_page (void *page)
   palloc_free_multiple (page, 1);
 }
 
+/* Returns the number of pages in the user pool. */
+size_t
+palloc_user_page_cnt (void)
+{
+  return bitmap_size (user_pool.used_map);
+}
+
+/* If PAGE is a page of the user pool, stores its index within
+   the pool, counting from 0 at the pool's base, in *IDX and
+   returns true.  Otherwise returns false.  Takes no lock: the
+   pool's bounds never change after palloc_init(). */
+bool
+palloc_user_index (const void *page, size_t *idx)
+{
+  size_t page_no = pg_no (page);
+  size_t start_page = pg_no (user_pool.base);
+
+  if (page_no < start_page
+      || page_no - start_page >= bitmap_size (user_pool.used_map))
+    return false;
+  *idx = page_no - start_page;
+  return true;
+}
+
 /* Initializes pool P as starting at START and ending at END,
    naming it NAME for debugging purposes. */
 static void
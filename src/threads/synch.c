@@ -422,6 +422,67 @@ void cond_broadcast(struct condition *cond, struct lock *lock)
 		cond_signal(cond, lock);
 }
 
+/* Initializes RW as an unheld readers-writer lock. */
+void rw_init(struct rwlock *rw)
+{
+	ASSERT(rw != NULL);
+
+	lock_init(&rw->lock);
+	cond_init(&rw->readers_ok);
+	cond_init(&rw->writers_ok);
+	rw->readers = 0;
+	rw->writers_waiting = 0;
+	rw->writer = false;
+}
+
+/* Acquires RW for reading, sleeping while a writer holds it or
+ waits for it. */
+void rw_read_acquire(struct rwlock *rw)
+{
+	lock_acquire(&rw->lock);
+	while (rw->writer || rw->writers_waiting > 0)
+		cond_wait(&rw->readers_ok, &rw->lock);
+	rw->readers++;
+	lock_release(&rw->lock);
+}
+
+/* Releases RW, held for reading by the current thread. */
+void rw_read_release(struct rwlock *rw)
+{
+	lock_acquire(&rw->lock);
+	ASSERT(rw->readers > 0);
+	if (--rw->readers == 0)
+		cond_signal(&rw->writers_ok, &rw->lock);
+	lock_release(&rw->lock);
+}
+
+/* Acquires RW for writing, sleeping until no reader or writer
+ holds it. */
+void rw_write_acquire(struct rwlock *rw)
+{
+	lock_acquire(&rw->lock);
+	rw->writers_waiting++;
+	while (rw->writer || rw->readers > 0)
+		cond_wait(&rw->writers_ok, &rw->lock);
+	rw->writers_waiting--;
+	rw->writer = true;
+	lock_release(&rw->lock);
+}
+
+/* Releases RW, held for writing by the current thread.  Hands it
+ to the next writer if there is one, otherwise to all readers. */
+void rw_write_release(struct rwlock *rw)
+{
+	lock_acquire(&rw->lock);
+	ASSERT(rw->writer);
+	rw->writer = false;
+	if (rw->writers_waiting > 0)
+		cond_signal(&rw->writers_ok, &rw->lock);
+	else
+		cond_broadcast(&rw->readers_ok, &rw->lock);
+	lock_release(&rw->lock);
+}
+
 bool sema_priority_less_helper(const struct list_elem *a,
 		const struct list_elem *b, void *aux)
 {
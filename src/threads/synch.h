@@ -53,6 +53,25 @@ void cond_wait(struct condition *, struct lock *);
 void cond_signal(struct condition *, struct lock *);
 void cond_broadcast(struct condition *, struct lock *);
 
+/* Readers-writer lock.  Any number of readers or a single writer
+ may hold it.  Waiting writers keep new readers out, so writers
+ do not starve. */
+struct rwlock
+{
+	struct lock lock; /* Protects the members below. */
+	struct condition readers_ok; /* Signaled when readers may enter. */
+	struct condition writers_ok; /* Signaled when a writer may enter. */
+	int readers; /* Number of readers holding the lock. */
+	int writers_waiting; /* Number of writers waiting. */
+	bool writer; /* True if a writer holds the lock. */
+};
+
+void rw_init(struct rwlock *);
+void rw_read_acquire(struct rwlock *);
+void rw_read_release(struct rwlock *);
+void rw_write_acquire(struct rwlock *);
+void rw_write_release(struct rwlock *);
+
 /* Optimization barrier.
 
  The compiler will not reorder operations across an
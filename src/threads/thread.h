@@ -148,6 +148,7 @@ struct thread
 #ifdef P4FILESYS
 	//Members defined for project 4
 	struct dir *working_dir;
+	int journal_depth; //nesting of journal_begin() calls
 #endif
 	/**************************/
 };
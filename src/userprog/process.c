@@ -649,8 +649,7 @@ static bool setup_stack(void **esp)
 	if (p != NULL)
 	{
 		*esp = PHYS_BASE;
-		VM_operation_page(OP_LOAD, p, p->physical_address, false);
-		success = true;
+		success = VM_operation_page(OP_LOAD, p, p->physical_address, false);
 	}
 #endif
 	return success;
@@ -224,9 +224,16 @@ int system_call_read(int fd, void *buffer, unsigned size)
 		if (f == NULL || f->d != NULL)
 			return -1;
 #ifndef VM
+#ifndef P4FILESYS
 		lock_acquire(&file_lock);
+#endif
+		//the buffer cache synchronizes sector access and each inode's
+		//layout lock keeps its block map stable against growing
+		//writers, so readers do not wait for each other's disk I/O
 		ret_val = file_read(f->f, buffer, size);
+#ifndef P4FILESYS
 		lock_release(&file_lock);
+#endif
 		return ret_val;
 #else
 		for (remaining = size; remaining > 0;
@@ -240,16 +247,23 @@ int system_call_read(int fd, void *buffer, unsigned size)
 			address = temp_buffer - offset;
 			struct page_struct *page = VM_find_page(address);
 
+			//load the page and pin it; a page that is already loaded is
+			//pinned too, since its frame may be shared with a process
+			//that unpins it in the meantime.  a new stack page comes
+			//back pinned
 			if (page == NULL)
-			if (stack_status)
-			page = VM_stack_grow(temp_buffer - offset, true);
-			else
+			{
+				if (!stack_status
+						|| (page = VM_stack_grow(temp_buffer - offset, true))
+								== NULL)
+				system_call_exit(-1);
+			}
+			else if ((!page->loaded
+					|| !VM_pin(true, page->physical_address, true))
+					&& !VM_operation_page(OP_LOAD, page,
+							page->physical_address, true))
 			system_call_exit(-1);
 
-			//load the page and pin it
-			if (!page->loaded)
-			VM_operation_page(OP_LOAD, page, page->physical_address, true);
-
 			left = offset + remaining;
 			if (left > PGSIZE)
 			bytes_read = remaining - left + PGSIZE;
@@ -1,4 +1,49 @@
 #include "vm/struct.h"
+#include "devices/timer.h"
+
+//times VM_get_frame() retries when every frame is pinned before giving up
+#define EVICT_RETRIES 10
+
+//eviction statistics
+static unsigned long long sweep_cnt; //calls to evict()
+static unsigned long long scan_cnt; //frames examined by the hand
+static unsigned long long chance_cnt; //accessed frames given a second chance
+static unsigned long long pinned_cnt; //pinned or free frames skipped
+static unsigned long long evict_cnt; //frames evicted
+static unsigned long long fail_cnt; //sweeps that found no victim
+static size_t longest_sweep; //most frames examined by one sweep
+
+//sharing statistics
+static unsigned long long share_hit_cnt; //loads that mapped a shared frame
+static unsigned long long share_reg_cnt; //frames registered for sharing
+
+static void free_frame(struct frame_struct *vf, uint32_t *pagedir);
+static unsigned share_hash(const struct hash_elem *e, void *aux);
+static bool share_less(const struct hash_elem *a_, const struct hash_elem *b_,
+		void *aux);
+
+//builds the frame table: one descriptor per user pool page, allocated
+//once here so that getting a frame never calls malloc
+void VM_frame_init(void)
+{
+	frame_cnt = palloc_user_page_cnt();
+	frame_table = malloc(frame_cnt * sizeof *frame_table);
+	if (frame_table == NULL && frame_cnt > 0)
+		PANIC("Unable to allocate the frame table");
+
+	clock_hand = 0;
+	hash_init(&hash_share, share_hash, share_less, NULL);
+	for (size_t i = 0; i < frame_cnt; i++)
+	{
+		struct frame_struct *vf = &frame_table[i];
+		vf->physical_address = NULL;
+		vf->in_use = false;
+		vf->pin_cnt = 0;
+		vf->shared = false;
+		list_init(&vf->shared_pages);
+		lock_init(&vf->page_list_lock);
+	}
+}
 
 void *VM_get_frame(void *frame, uint32_t *pagedir, enum palloc_flags flags)
 {
@@ -7,27 +52,36 @@ void *VM_get_frame(void *frame, uint32_t *pagedir, enum palloc_flags flags)
 	{
 		struct frame_struct *vf = NULL;
 		void *address = palloc_get_page(flags);
+		int retries = 0;
+		size_t idx;
 
-		//if allocation was unsuccessful
-		if (address == NULL)
+		//if allocation was unsuccessful, evict until a page frees up; if
+		//every frame stays pinned, give up and return a null pointer,
+		//which the caller must check
+		while (address == NULL)
 		{
-			evict();
-			return VM_get_frame(NULL, NULL, flags);
+			if (!evict())
+			{
+				if (++retries > EVICT_RETRIES)
+					return NULL;
+				timer_sleep(1);
+			}
+			address = palloc_get_page(flags);
 		}
 
 		//otherwise, proceed
-		vf = (struct frame_struct *) malloc(sizeof(struct frame_struct));
-		if (vf != NULL)
+		if (palloc_user_index(address, &idx))
 		{
+			vf = &frame_table[idx];
+			ASSERT(!vf->in_use);
+			ASSERT(list_empty(&vf->shared_pages));
 			vf->physical_address = address;
-			vf->persistent = true;
-			list_init(&vf->shared_pages);
-			lock_init(&vf->page_list_lock);
-
-			lock_acquire(&l[LOCK_FRAME]);
-			list_push_front(&hash_frame_list, &vf->frame_list_elem);
-			hash_insert(&hash_frame, &vf->hash_elem);
-			lock_release(&l[LOCK_FRAME]);
+			vf->pin_cnt = 1;
+
+			//the clock hand reads in_use without a lock: publish the frame
+			//only once it is pinned
+			barrier();
+			vf->in_use = true;
 		}
 		return address;
 	}
@@ -62,17 +116,21 @@ void *VM_get_frame(void *frame, uint32_t *pagedir, enum palloc_flags flags)
 //frees frame and writes data to swap
 void VM_free_frame(void *address, uint32_t *pagedir)
 {
-	lock_acquire(&l[LOCK_EVICT]);
 	struct frame_struct *vf = NULL;
-	struct page_struct *page = NULL;
-	struct list_elem *e;
 
+	lock_acquire(&l[LOCK_EVICT]);
 	vf = address_to_frame(address);
-	if (vf == NULL)
-	{
-		lock_release(&l[LOCK_EVICT]);
-		return;
-	}
+	if (vf != NULL)
+		free_frame(vf, pagedir);
+	lock_release(&l[LOCK_EVICT]);
+}
+
+//does the work of VM_free_frame() for frame VF.  LOCK_EVICT must be held
+static void free_frame(struct frame_struct *vf, uint32_t *pagedir)
+{
+	void *address = vf->physical_address;
+	struct page_struct *page = NULL;
+	struct list_elem *e;
 
 	if (pagedir == NULL)
 	{
@@ -104,19 +162,18 @@ void VM_free_frame(void *address, uint32_t *pagedir)
 	}
 
 	if (!list_empty(&vf->shared_pages))
-	{
-		lock_release(&l[LOCK_EVICT]);
 		return;
-	}
 
-	lock_acquire(&l[LOCK_FRAME]);
-	hash_delete(&hash_frame, &vf->hash_elem);
-	list_remove(&vf->frame_list_elem);
-	free(vf);
-	lock_release(&l[LOCK_FRAME]);
+	if (vf->shared)
+	{
+		lock_acquire(&l[LOCK_SHARE]);
+		hash_delete(&hash_share, &vf->share_elem);
+		vf->shared = false;
+		lock_release(&l[LOCK_SHARE]);
+	}
+	vf->in_use = false;
+	vf->pin_cnt = 0;
 	palloc_free_page(address);
-
-	lock_release(&l[LOCK_EVICT]);
 }
 
 bool eviction_clock(struct frame_struct *f)
@@ -138,58 +195,197 @@ bool eviction_clock(struct frame_struct *f)
 	return true;
 }
 
-void evict()
+//evicts one frame chosen by the CLOCK algorithm: the hand keeps its
+//position between calls, skips pinned frames and gives accessed frames a
+//second chance.  a sweep examines at most two revolutions, enough to clear
+//every accessed bit once and come back to it.  returns false without
+//evicting if every frame was pinned or kept being referenced
+bool evict(void)
 {
-	lock_acquire(&l[LOCK_EVICT]);
-	lock_acquire(&l[LOCK_FRAME]);
 	struct frame_struct *frame_to_evict = NULL;
-	struct list_elem *e = list_end(&hash_frame_list);
-	struct frame_struct *cur_frame = list_entry(e, struct frame_struct,
-			frame_list_elem);
+	size_t scanned;
 
-	while (true)
+	lock_acquire(&l[LOCK_EVICT]);
+	sweep_cnt++;
+	for (scanned = 0; scanned < 2 * frame_cnt; scanned++)
 	{
-		//printf("stuck in while loop");
-		cur_frame = list_entry(e, struct frame_struct, frame_list_elem);
-		if (cur_frame == NULL)
-			PANIC("Something wrong with eviction");
+		struct frame_struct *cur_frame = &frame_table[clock_hand];
+		clock_hand = (clock_hand + 1) % frame_cnt;
 
-		if (cur_frame->persistent == true || !eviction_clock(cur_frame))
+		if (!cur_frame->in_use)
+		{
+			pinned_cnt++;
+			continue;
+		}
+		lock_acquire(&cur_frame->page_list_lock);
+		if (cur_frame->pin_cnt != 0)
+		{
+			lock_release(&cur_frame->page_list_lock);
+			pinned_cnt++;
+			continue;
+		}
+		if (!eviction_clock(cur_frame))
 		{
-			if (e == NULL || e == list_begin(&hash_frame_list))
-				e = list_end(&hash_frame_list);
-			else
-				e = list_prev(e);
+			lock_release(&cur_frame->page_list_lock);
+			chance_cnt++;
 			continue;
 		}
 
+		//pin the victim: LOCK_EVICT stays held until it is freed, but a
+		//syscall must not pin it meanwhile either
+		cur_frame->pin_cnt++;
+		lock_release(&cur_frame->page_list_lock);
 		frame_to_evict = cur_frame;
+		scanned++;
 		break;
 	}
-
-	lock_release(&l[LOCK_FRAME]);
+	scan_cnt += scanned;
+	if (scanned > longest_sweep)
+		longest_sweep = scanned;
+	if (frame_to_evict == NULL)
+		fail_cnt++;
+	else
+	{
+		//detach the victim from its pages before anyone else may pick
+		//or free it
+		evict_cnt++;
+		free_frame(frame_to_evict, NULL);
+	}
 	lock_release(&l[LOCK_EVICT]);
-	VM_free_frame(frame_to_evict->physical_address, NULL);
+	return frame_to_evict != NULL;
 }
 
-struct frame_struct *address_to_frame(void *address)
+//returns true if PAGE holds read-only file contents that are the same in
+//every process that maps it, so that its frame may be shared
+static bool share_possible(struct page_struct *page)
+{
+	return page->type == TYPE_FILE && !page->writable && page->bid > 0
+			&& page->file != NULL;
+}
+
+//hashes a frame by the identity of the file page it holds
+static unsigned share_hash(const struct hash_elem *e, void *aux UNUSED)
+{
+	const struct frame_struct *f = hash_entry(e, struct frame_struct,
+			share_elem);
+	unsigned h = hash_bytes(&f->share_inode, sizeof f->share_inode);
+	h ^= hash_int(f->share_bid);
+	return h ^ hash_int(f->share_read_bytes);
+}
+
+//orders frames by the identity of the file page they hold
+static bool share_less(const struct hash_elem *a_, const struct hash_elem *b_,
+		void *aux UNUSED)
+{
+	const struct frame_struct *a = hash_entry(a_, struct frame_struct,
+			share_elem);
+	const struct frame_struct *b = hash_entry(b_, struct frame_struct,
+			share_elem);
+
+	if (a->share_inode != b->share_inode)
+		return a->share_inode < b->share_inode;
+	if (a->share_bid != b->share_bid)
+		return a->share_bid < b->share_bid;
+	return a->share_read_bytes < b->share_read_bytes;
+}
+
+//maps PAGE onto a frame that already holds the same read-only file page
+//for another process, pinning it if PINNED.  returns false, leaving PAGE
+//untouched, if there is no such frame.  runs under LOCK_EVICT so that the
+//frame cannot be evicted half way; eviction later unmaps PAGE along with
+//the frame's other sharers through shared_pages
+bool VM_share_page(struct page_struct *page, bool pinned)
 {
-	struct frame_struct f;
-	f.physical_address = address;
+	struct frame_struct key;
+	struct frame_struct *vf;
+	struct hash_elem *e;
 
-	if (f.physical_address != NULL)
+	if (!share_possible(page))
+		return false;
+	key.share_inode = file_get_inode(page->file);
+	key.share_bid = page->bid;
+	key.share_read_bytes = page->read_bytes;
+
+	lock_acquire(&l[LOCK_EVICT]);
+	lock_acquire(&l[LOCK_SHARE]);
+	e = hash_find(&hash_share, &key.share_elem);
+	vf = e != NULL ? hash_entry(e, struct frame_struct, share_elem) : NULL;
+	if (vf != NULL)
 	{
-		lock_acquire(&l[LOCK_FRAME]);
-		struct hash_elem *e;
-		e = hash_find(&hash_frame, &f.hash_elem);
-		lock_release(&l[LOCK_FRAME]);
-		if (e == NULL)
-			return NULL;
+		pagedir_clear_page(page->pagedir, page->virtual_address);
+		if (pagedir_set_page(page->pagedir, page->virtual_address,
+				vf->physical_address, false))
+		{
+			lock_acquire(&vf->page_list_lock);
+			list_push_back(&vf->shared_pages, &page->frame_elem);
+			if (pinned)
+				vf->pin_cnt++;
+			lock_release(&vf->page_list_lock);
+
+			page->physical_address = vf->physical_address;
+			pagedir_set_dirty(page->pagedir, page->virtual_address, false);
+			pagedir_set_accessed(page->pagedir, page->virtual_address, true);
+			page->loaded = true;
+			share_hit_cnt++;
+		}
 		else
 		{
-			e = hash_entry(e, struct frame_struct, hash_elem);
-			return e;
+			pagedir_op_page(page->pagedir, page->virtual_address, (void *) page);
+			vf = NULL;
 		}
 	}
-	return NULL;
+	lock_release(&l[LOCK_SHARE]);
+	lock_release(&l[LOCK_EVICT]);
+	return vf != NULL;
+}
+
+//offers PAGE's frame, just filled from the file, to other processes that
+//map the same read-only file page.  does nothing if the page cannot be
+//shared or an equal frame is already registered
+void VM_share_register(struct page_struct *page)
+{
+	struct frame_struct *vf;
+
+	if (!share_possible(page))
+		return;
+	vf = address_to_frame(page->physical_address);
+	if (vf == NULL || vf->shared)
+		return;
+
+	vf->share_inode = file_get_inode(page->file);
+	vf->share_bid = page->bid;
+	vf->share_read_bytes = page->read_bytes;
+	lock_acquire(&l[LOCK_SHARE]);
+	if (hash_insert(&hash_share, &vf->share_elem) == NULL)
+	{
+		vf->shared = true;
+		share_reg_cnt++;
+	}
+	lock_release(&l[LOCK_SHARE]);
+}
+
+//prints eviction statistics
+void VM_print_stats(void)
+{
+	printf("Eviction: %llu sweeps, %llu frames evicted, %llu sweeps failed\n",
+			sweep_cnt, evict_cnt, fail_cnt);
+	printf("Eviction: %llu frames scanned (longest sweep %zu), "
+			"%llu second chances, %llu pinned or free skipped\n", scan_cnt,
+			longest_sweep, chance_cnt, pinned_cnt);
+	printf("Sharing: %llu read-only frames shared, %llu loads mapped "
+			"a shared frame\n", share_reg_cnt, share_hit_cnt);
+}
+
+//returns the frame descriptor for the user page at ADDRESS, or NULL if
+//ADDRESS is not a frame in use; indexes the frame table, so no lock is
+//needed
+struct frame_struct *address_to_frame(void *address)
+{
+	size_t idx;
+
+	if (address == NULL || !palloc_user_index(address, &idx))
+		return NULL;
+	if (!frame_table[idx].in_use)
+		return NULL;
+	return &frame_table[idx];
 }
@@ -4,12 +4,19 @@
 #include "vm/struct.h"
 #include "threads/palloc.h"
 
+struct page_struct;
+
+void VM_frame_init(void);
 void VM_free_frame(void *address, uint32_t *pagedir);
 
 void *VM_get_frame(void *frame, uint32_t *pagedir, enum palloc_flags flags);
 
 struct frame_struct *address_to_frame(void *address);
 
-void evict(void);
+bool evict(void);
 bool eviction_clock(struct frame_struct *vf);
+void VM_print_stats(void);
+
+bool VM_share_page(struct page_struct *page, bool pinned);
+void VM_share_register(struct page_struct *page);
 #endif
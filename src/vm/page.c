@@ -8,9 +8,8 @@ void VM_init(void)
 	{
 		lock_init(&l[i]);
 	}
-	hash_init(&hash_frame, frame_hash, frame_less_helper, NULL);
+	VM_frame_init();
 	hash_init(&hash_mmap, mmap_hash, mmap_less_helper, NULL);
-	list_init(&hash_frame_list);
 	swap_block = block_get_role(BLOCK_SWAP);
 	swap_size = block_size(swap_block);
 	swap_bitmap = bitmap_create(swap_size);
@@ -63,8 +62,9 @@ struct page_struct *VM_new_page(int type, void *virt_address, bool writable,
 	return NULL;
 }
 
-//setting the operation to true pins the page
-//returns true if the operation is successful
+//setting the operation to true adds a pin to the page's frame, false
+//drops one; a frame shared by several processes stays pinned until
+//every pin is dropped.  returns true if the operation is successful
 //directFrameAccess allows you to pin the frame
 bool VM_pin(bool operation, void *pagetemp, bool directFrameAccess)
 {
@@ -77,19 +77,16 @@ bool VM_pin(bool operation, void *pagetemp, bool directFrameAccess)
 		struct frame_struct *f = address_to_frame(address);
 		if (f != NULL)
 		{
-			switch (operation)
+			lock_acquire(&f->page_list_lock);
+			if (operation)
+				f->pin_cnt++;
+			else
 			{
-			case true:
-				f->persistent = true;
-				return true;
-				break;
-			case false:
-				f->persistent = false;
-				return true;
-				break;
-			default:
-				return false;
+				ASSERT(f->pin_cnt > 0);
+				f->pin_cnt--;
 			}
+			lock_release(&f->page_list_lock);
+			return true;
 		}
 	}
 	return false;
@@ -104,12 +101,23 @@ bool VM_operation_page(int operation, void *address, void * kpage, bool pinned)
 
 		struct page_struct *page = (struct page_struct *) address;
 
+		//map a frame another process already loaded with the same text
+		if (page->physical_address == NULL && VM_share_page(page, pinned))
+		{
+			lock_release(&l[LOCK_LOAD]);
+			return true;
+		}
+
 		//get empty frame
 		if (page->physical_address == NULL)
 			page->physical_address = VM_get_frame(NULL, NULL, PAL_USER);
 
 		lock_release(&l[LOCK_LOAD]);
 
+		//every frame stayed pinned: fail the load, killing the process
+		if (page->physical_address == NULL)
+			return false;
+
 		//creates mapping from page to frame
 		struct frame_struct *vf = address_to_frame(page->physical_address);
 		if (vf == NULL)
@@ -137,6 +145,7 @@ bool VM_operation_page(int operation, void *address, void * kpage, bool pinned)
 			{
 				void *block = page->physical_address + page->read_bytes;
 				memset(block, 0, page->zero_bytes);
+				VM_share_register(page);
 				success = true;
 			}
 		}
@@ -151,19 +160,12 @@ bool VM_operation_page(int operation, void *address, void * kpage, bool pinned)
 			int blocks_in_one_page = PGSIZE / BLOCK_SECTOR_SIZE;
 
 			lock_acquire(&l[LOCK_SWAP]);
-			while (offset < blocks_in_one_page)
-			{
-				if (bitmap_test(swap_bitmap, i) && i < swap_size)
-				{
-					void *buffer = address + offset * BLOCK_SECTOR_SIZE;
-					block_read(swap_block, i, buffer);
-				}
-				else
-					PANIC("Problem when loading a page from swap to main mem");
-
-				i++;
-				offset++;
-			}
+			//the page's sectors are consecutive: read them in one request
+			if (i + blocks_in_one_page <= swap_size
+					&& bitmap_all(swap_bitmap, i, blocks_in_one_page))
+				block_read_multi(swap_block, i, blocks_in_one_page, address);
+			else
+				PANIC("Problem when loading a page from swap to main mem");
 
 			//Free the swap frame
 			offset = 0;
@@ -181,11 +183,9 @@ bool VM_operation_page(int operation, void *address, void * kpage, bool pinned)
 			lock_release(&l[LOCK_SWAP]);
 		}
 
+		//the frame, and its pin, went away with VM_free_frame()
 		if (!success)
-		{
-			VM_pin(false, page->physical_address, true);
 			return false;
-		}
 
 		pagedir_clear_page(page->pagedir, page->virtual_address);
 		bool s = pagedir_set_page(page->pagedir, page->virtual_address,
@@ -213,13 +213,14 @@ bool VM_operation_page(int operation, void *address, void * kpage, bool pinned)
 				&& pagedir_is_dirty(page->pagedir, page->virtual_address)
 				&& !file_check_write(page->file))
 		{
-			VM_pin(true, kpage, true);
+			//only VM_free_frame() unloads, holding LOCK_EVICT and
+			//sometimes the frame's page_list_lock, so the frame cannot be
+			//evicted under us and is not pinned again here
 			lock_acquire(&file_lock);
 
 			file_seek(page->file, page->offset);
 			file_write(page->file, kpage, page->read_bytes);
 			lock_release(&file_lock);
-			VM_pin(false, kpage, true);
 		}
 		else if (page->type == TYPE_SWAP
 				|| pagedir_is_dirty(page->pagedir, page->virtual_address))
@@ -237,20 +238,11 @@ bool VM_operation_page(int operation, void *address, void * kpage, bool pinned)
 
 			if (index != BITMAP_ERROR)
 			{
-				size_t offset = 0;
-				size_t i = index;
-				while (offset < blocks_in_one_page)
-				{
-					if (bitmap_test(swap_bitmap, i) && (index < swap_size))
-					{
-						block_write(swap_block, i,
-								addr + offset * BLOCK_SECTOR_SIZE);
-						i++;
-						offset++;
-					}
-					else
-						PANIC("Problem when moving a page from memory to swap");
-				}
+				if (index + blocks_in_one_page <= swap_size)
+					block_write_multi(swap_block, index, blocks_in_one_page,
+							addr);
+				else
+					PANIC("Problem when moving a page from memory to swap");
 			}
 			else
 			{
@@ -344,24 +336,6 @@ struct page_struct *VM_find_page(void *address)
 	return NULL;
 }
 
-unsigned frame_hash(const struct hash_elem *f_, void *aux UNUSED)
-{
-	const struct frame_struct *f = hash_entry(f_, struct frame_struct,
-			hash_elem);
-	return hash_int((unsigned) f->physical_address);
-}
-
-bool frame_less_helper(const struct hash_elem *a_, const struct hash_elem *b_,
-		void *aux UNUSED)
-{
-	const struct frame_struct *a = hash_entry(a_, struct frame_struct,
-			hash_elem);
-	const struct frame_struct *b = hash_entry(b_, struct frame_struct,
-			hash_elem);
-
-	return a->physical_address < b->physical_address;
-}
-
 unsigned mmap_hash(const struct hash_elem *mf_, void *aux UNUSED)
 {
 	const struct mmap_struct *mf = hash_entry(mf_, struct mmap_struct,
@@ -15,10 +15,6 @@ void VM_init(void);
 struct page_struct *VM_stack_grow(void *address, bool pin);
 struct page_struct *VM_find_page(void *address);
 
-unsigned frame_hash(const struct hash_elem *f_, void *aux);
-bool frame_less_helper(const struct hash_elem *a_, const struct hash_elem *b_,
-		void *aux);
-
 unsigned mmap_hash(const struct hash_elem *mf_, void *aux);
 bool mmap_less_helper(const struct hash_elem *a_, const struct hash_elem *b_,
 		void *aux);
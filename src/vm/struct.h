@@ -21,7 +21,7 @@
 #include "threads/pte.h"
 
 //an array of locks for various purposes
-#define NO_OF_LOCKS 7
+#define NO_OF_LOCKS 8
 struct lock l[NO_OF_LOCKS];
 #define LOCK_LOAD 0
 #define LOCK_UNLOAD 1
@@ -30,6 +30,7 @@ struct lock l[NO_OF_LOCKS];
 #define LOCK_EVICT 4
 #define LOCK_SWAP 5
 #define LOCK_MMAP 6
+#define LOCK_SHARE 7
 
 //determines the type of the file
 #define TYPE_ZERO 0
@@ -66,17 +67,27 @@ struct page_struct
 /********************************
  * For Frame
  */
-struct hash hash_frame;
-struct list hash_frame_list;
+//one descriptor per user pool page, indexed by palloc_user_index()
+struct frame_struct *frame_table;
+size_t frame_cnt;
+size_t clock_hand; //next frame_table index the eviction clock examines
+struct hash hash_share; //read-only file frames by (inode, block, bytes)
 
 struct frame_struct
 {
 	void *physical_address; //Physical address of the frame
-	bool persistent; //determines if the frame is pinned or not
+	bool in_use; //determines if the frame is allocated
+	int pin_cnt; //pins held by loads, syscalls and eviction, changed
+	//under page_list_lock; the frame is never evicted while nonzero
 	struct list shared_pages; //list of all pages that share this frame
-	struct list_elem frame_list_elem; //list element for the frames list
 	struct lock page_list_lock; //page access is synchronized using
-	struct hash_elem hash_elem; //for hash frame table
+
+	//identity of a read-only file page, if the frame is in hash_share
+	bool shared; //determines if the frame is in hash_share
+	struct inode *share_inode; //inode the contents came from
+	off_t share_bid; //inode block index of the page's first byte
+	size_t share_read_bytes; //bytes read from the file, rest are zeros
+	struct hash_elem share_elem; //for hash_share
 };
 
 /********************************